@@ -0,0 +1,448 @@
+// CNC controller simulator for running metadrill without a machine
+// gcc -o cncsim -ggdb -Wall -O2 cncsim.c -lm
+//
+// Opens a pseudo-terminal, prints the name of its slave side (give it to
+// metadrill as COMx) and answers every G-code line with "ok" like the
+// controller does. The lines are moved through a model of the serial
+// line (baud rate), the parser (latency) and the planner buffer of the
+// controller, and the moves are timed with a trapezoidal velocity
+// profile per axis. When metadrill closes the port the statistics are
+// printed: machine time, time the machine was waiting for the host, and
+// the throughput of the serial path.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <signal.h>
+
+// baud rate of the simulated serial line (metadrill uses 38400)
+#define SIM_BAUD 38400
+
+// time (ms) the controller needs to parse a line
+#define SIM_LATENCY 1.0
+
+// number of moves the planner of the controller can hold
+#define SIM_PLANNER_BLOCKS 16
+
+// max. speed (mm/min) and acceleration (mm/s^2) of the axes
+#define SIM_SPEED_XY 400
+#define SIM_SPEED_Z 200
+#define SIM_ACCEL_XY 50
+#define SIM_ACCEL_Z 50
+
+// This is to not confuse the VIM syntax highlighting
+#define CHECK_VAL_OPEN (
+#define CHECK_VAL_CLOSE )
+
+#define CHECK(result, check)                                          \
+  CHECK_VAL_OPEN{                                                     \
+    typeof(result) _R = (result);                                     \
+    if (!(_R check)) {                                                \
+      fprintf(stderr, "Error from '%s' (%d %s) in %s:%d.\n",          \
+                      #result, (int)_R, #check, __FILE__, __LINE__);  \
+      fprintf(stderr, "ERRNO(%d): %s\n", errno, strerror(errno));     \
+      exit(1);                                                        \
+    }                                                                 \
+    _R;                                                               \
+  }CHECK_VAL_CLOSE
+
+int baud = SIM_BAUD;
+double latency = SIM_LATENCY / 1000;
+int planner_blocks = SIM_PLANNER_BLOCKS;
+double time_scale = 1;
+int verbose;
+
+/*
+ * Machine state: position, modal state of the G-code interpreter and the
+ * end times (wall clock seconds) of the moves in the planner buffer.
+ */
+struct machine {
+	double x, y, z;
+	double feed;		// mm/min
+	int motion;		// 0, 1, 81, 83 or -1 (none)
+	int retract_r;		// G99
+	double r, q;
+	double planner_end[256];
+	int planner_first, planner_count;
+	double busy_until;	// end of the last planned move
+};
+
+struct stats {
+	long lines, bytes, errors, holes;
+	double motion_time;	// sum of the move times
+	double idle_time;	// planner empty while the host was sending
+	double z_travel;
+};
+
+struct machine m = { .feed = SIM_SPEED_XY, .motion = -1 };
+struct stats st;
+
+double get_time()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * The serial line and the parser run in real time, the moves time_scale
+ * times faster (0: the moves take no time, to measure the serial path
+ * alone). All times are wall clock seconds since t0. The line is full
+ * duplex: the received bytes, the parser and the answers each have their
+ * own timeline, so a host that keeps lines in flight (character counting)
+ * gets ahead of one that waits for every "ok".
+ */
+double t0;
+double rx_busy_until;	// arrival of the last received byte
+double parser_time;	// the parser is done with the previous line
+double tx_busy_until;	// the last answer is sent
+
+double sim_now()
+{
+	return get_time() - t0;
+}
+
+void sim_wait_until(double t)
+{
+	double d = t - sim_now();
+	if (d > 0) {
+		struct timespec ts = { d, (d - (long)d) * 1e9 };
+		nanosleep(&ts, NULL);
+	}
+}
+
+// time (s) for a move of length d (mm) with max. speed v (mm/s) and acceleration a
+double move_time(double d, double v, double a)
+{
+	d = fabs(d);
+	if (d <= v*v / a)
+		return 2 * sqrt(d / a);
+	return d / v + v / a;
+}
+
+// time of a move to x/y/z, the axes move independently, a feed (mm/min) limits the speed
+double move(double x, double y, double z, double feed)
+{
+	double vxy = SIM_SPEED_XY / 60.0, vz = SIM_SPEED_Z / 60.0;
+	if (feed > 0) {
+		vxy = fmin(vxy, feed / 60);
+		vz = fmin(vz, feed / 60);
+	}
+	double t = fmax(move_time(x - m.x, vxy, SIM_ACCEL_XY),
+			move_time(y - m.y, vxy, SIM_ACCEL_XY));
+	t = fmax(t, move_time(z - m.z, vz, SIM_ACCEL_Z));
+	st.z_travel += fabs(z - m.z);
+	m.x = x;
+	m.y = y;
+	m.z = z;
+	return t;
+}
+
+// remove the moves that are done from the planner buffer
+void planner_retire(double now)
+{
+	while (m.planner_count > 0 && m.planner_end[m.planner_first] <= now) {
+		m.planner_first = (m.planner_first + 1) % planner_blocks;
+		m.planner_count--;
+	}
+}
+
+// add a move of t seconds at parser_time, the parser waits while the planner buffer is full
+void planner_add(double t)
+{
+	if (t <= 0)
+		return;
+	st.motion_time += t;
+	if (time_scale <= 0)
+		return;
+
+	planner_retire(parser_time);
+	if (m.planner_count == planner_blocks) {
+		parser_time = m.planner_end[m.planner_first];
+		planner_retire(parser_time);
+	}
+
+	// the machine stands still when the planner ran empty
+	double now = parser_time, start = m.busy_until;
+	if (now > start) {
+		if (st.motion_time > t)
+			st.idle_time += (now - start) * time_scale;
+		start = now;
+	}
+	m.busy_until = start + t / time_scale;
+	m.planner_end[(m.planner_first + m.planner_count) % planner_blocks] = m.busy_until;
+	m.planner_count++;
+}
+
+int get_word(const char *line, char letter, double *v)
+{
+	const char *p;
+	for (p=line; *p; p++)
+		if (*p == letter)
+			return sscanf(p+1, "%lf", v) == 1;
+	return 0;
+}
+
+/*
+ * Execute one line. Supports what metadrill sends: G0, G1, G80, G81,
+ * G83, G90, G92, G98, G99 and the M and T words (no motion). Returns 0
+ * for lines that aren't understood.
+ */
+int execute(const char *line)
+{
+	double x = m.x, y = m.y, z = m.z, v;
+	int have_xyz = 0, g = -1;
+	const char *p;
+
+	for (p=line; *p; p++) {
+		if (*p != 'G')
+			continue;
+		g = atoi(p+1);
+		switch (g) {
+		case 0: case 1: case 81: case 83:
+			m.motion = g;
+			break;
+		case 80:
+			m.motion = -1;
+			break;
+		case 98: case 99:
+			m.retract_r = g == 99;
+			break;
+		case 90: case 92:
+			break;
+		default:
+			return 0;
+		}
+	}
+	if (get_word(line, 'F', &v))
+		m.feed = v;
+	if (get_word(line, 'R', &v))
+		m.r = v;
+	if (get_word(line, 'Q', &v))
+		m.q = v;
+	if (get_word(line, 'X', &x) | get_word(line, 'Y', &y) | get_word(line, 'Z', &z))
+		have_xyz = 1;
+
+	if (strstr(line, "G92")) {
+		m.x = x;
+		m.y = y;
+		m.z = z;
+		return 1;
+	}
+	if (!have_xyz || m.motion < 0)
+		return 1;
+
+	if (m.motion == 0 || m.motion == 1) {
+		planner_add(move(x, y, z, m.motion == 1 ? m.feed : 0));
+		return 1;
+	}
+
+	// canned cycle: XY rapid, R rapid, Z at the feed (pecks with G83), retract
+	double initial_z = m.z, t = 0;
+	t += move(x, y, fmax(m.z, m.r), 0);
+	t += move(x, y, m.r, 0);
+	if (m.motion == 83 && m.q > 0) {
+		double depth = m.r;
+		while (depth > z) {
+			depth = fmax(depth - m.q, z);
+			t += move(x, y, depth, m.feed);
+			if (depth > z) {
+				t += move(x, y, m.r, 0);
+				t += move(x, y, depth, 0);
+			}
+		}
+	} else {
+		t += move(x, y, z, m.feed);
+	}
+	t += move(x, y, m.retract_r ? m.r : fmax(initial_z, m.r), 0);
+	planner_add(t);
+	st.holes++;
+	return 1;
+}
+
+// time (s) to transfer n bytes over the serial line (8N1)
+double serial_time(int n)
+{
+	return baud > 0 ? n * 10.0 / baud : 0;
+}
+
+/*
+ * Answers on their way to the host: each is written when its last byte
+ * has arrived there, while the next lines are received and parsed.
+ */
+#define SIM_TX_QUEUE 1024
+
+struct tx_answer {
+	double time;
+	const char *text;
+} tx_queue[SIM_TX_QUEUE];
+int tx_first, tx_count;
+
+// write the answers that arrive until time t, returns the time of the next one (-1: none)
+double answer_flush(int fd, double t)
+{
+	while (tx_count > 0 && tx_queue[tx_first].time <= t) {
+		struct tx_answer *a = &tx_queue[tx_first];
+		sim_wait_until(a->time);
+		CHECK(write(fd, a->text, strlen(a->text)), > 0);
+		tx_first = (tx_first + 1) % SIM_TX_QUEUE;
+		tx_count--;
+	}
+	return tx_count > 0 ? tx_queue[tx_first].time : -1;
+}
+
+// answer the line the parser is done with at parser_time
+void answer(int fd, const char *text)
+{
+	if (tx_count == SIM_TX_QUEUE)
+		answer_flush(fd, tx_queue[tx_first].time);
+	tx_busy_until = fmax(parser_time, tx_busy_until) + serial_time(strlen(text));
+	tx_queue[(tx_first + tx_count) % SIM_TX_QUEUE].time = tx_busy_until;
+	tx_queue[(tx_first + tx_count) % SIM_TX_QUEUE].text = text;
+	tx_count++;
+}
+
+void print_stats(double wall)
+{
+	fprintf(stderr, "Lines: %ld (%ld bytes, %ld errors), canned cycle holes: %ld\n",
+			st.lines, st.bytes, st.errors, st.holes);
+	fprintf(stderr, "Machine time: %.2f s moving", st.motion_time);
+	if (time_scale > 0)
+		fprintf(stderr, ", %.2f s waiting for the host", st.idle_time);
+	fprintf(stderr, ", %.1f mm Z travel\n", st.z_travel);
+	if (wall > 0)
+		fprintf(stderr, "Wall time: %.2f s, %.1f lines/s, %.0f bytes/s\n",
+				wall, st.lines / wall, st.bytes / wall);
+}
+
+void usage()
+{
+	fprintf(stderr, "Usage: cncsim [ -b baud ] [ -l latency_ms ] [ -p blocks ] [ -x scale ]\n"
+			"\t[ -L link ] [ -v ]\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	const char *link_name = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "b:l:p:x:L:v")) != -1) {
+		switch (opt) {
+		case 'b':
+			baud = atoi(optarg);
+			break;
+		case 'l':
+			latency = atof(optarg) / 1000;
+			break;
+		case 'p':
+			planner_blocks = CHECK(atoi(optarg), > 0);
+			CHECK(planner_blocks, <= 256);
+			break;
+		case 'x':
+			time_scale = atof(optarg);
+			break;
+		case 'L':
+			link_name = optarg;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	int fd = CHECK(posix_openpt(O_RDWR | O_NOCTTY), >= 0);
+	CHECK(grantpt(fd), == 0);
+	CHECK(unlockpt(fd), == 0);
+	const char *slave = ptsname(fd);
+	if (slave == NULL) {
+		fprintf(stderr, "Can't get the name of the pseudo-terminal: %s\n", strerror(errno));
+		exit(1);
+	}
+
+	// raw mode, so the answers aren't changed on the way
+	struct termios tio;
+	int sfd = CHECK(open(slave, O_RDWR | O_NOCTTY), >= 0);
+	CHECK(tcgetattr(sfd, &tio), == 0);
+	cfmakeraw(&tio);
+	CHECK(tcsetattr(sfd, TCSANOW, &tio), == 0);
+
+	if (link_name) {
+		unlink(link_name);
+		CHECK(symlink(slave, link_name), == 0);
+	}
+	printf("%s\n", slave);
+	fflush(stdout);
+	signal(SIGPIPE, SIG_IGN);
+
+	// keep sfd open until the first byte, then the end of metadrill is an EIO
+	char buffer[4096], line[514];
+	int len = 0, started = 0;
+	double wall0 = 0;
+	t0 = get_time();
+
+	while (1) {
+		// wait for more lines, but not past the next answer
+		double next = answer_flush(fd, sim_now());
+		int timeout = next < 0 ? -1 : ceil(fmax(next - sim_now(), 0) * 1000);
+		struct pollfd pfd = { fd, POLLIN, 0 };
+		int ready = poll(&pfd, 1, timeout);
+		if ((ready < 0 && errno == EINTR) || ready == 0)
+			continue;
+		int n = read(fd, buffer, sizeof(buffer));
+		if (n <= 0)
+			break;
+		if (!started) {
+			close(sfd);
+			started = 1;
+			wall0 = get_time();
+			t0 = wall0;
+		}
+
+		// the bytes arrive one after the other, from when the host wrote them
+		double now = sim_now();
+		int i;
+		for (i=0; i<n; i++) {
+			rx_busy_until = fmax(rx_busy_until, now) + serial_time(1);
+			if (buffer[i] == '\r')
+				continue;
+			if (buffer[i] != '\n') {
+				if (len < (int)sizeof(line)-1)
+					line[len++] = buffer[i];
+				continue;
+			}
+			line[len] = 0;
+			st.lines++;
+			st.bytes += len + 1;
+			if (verbose)
+				fprintf(stderr, "%s\n", line);
+
+			// parsed when it is complete and the parser is done with the previous line
+			parser_time = fmax(rx_busy_until, parser_time) + latency;
+			if (execute(line)) {
+				answer(fd, "ok\r\n");
+			} else {
+				st.errors++;
+				answer(fd, "error: unsupported command\r\n");
+			}
+			len = 0;
+		}
+	}
+
+	double wall = get_time() - wall0;
+	sim_wait_until(m.busy_until);
+	if (link_name)
+		unlink(link_name);
+	print_stats(started ? wall : 0);
+	return 0;
+}
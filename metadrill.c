@@ -7,24 +7,108 @@
 #include <unistd.h>
 #include <errno.h>
 #include <math.h>
+#include <time.h>
+#include <stdint.h>
 
 #include <SDL/SDL.h>
 #include <SDL/SDL_ttf.h>
 
+#ifdef __BMI2__
+#  include <immintrin.h>
+#endif
+
 #ifdef WIN32
 #  include <io.h>
 #  include <windows.h>
 #else
 #  include <termios.h>
+#  include <fcntl.h>
+#  include <poll.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <dirent.h>
 #endif
 
+// coordinates are kept as int64 nanometres from the parser to the G-code
+#define NM_PER_MM 1000000LL
+
 #define Z_VALUE_UP (cnc_z)
-#define Z_VALUE_MID (cnc_z-3)
-#define Z_VALUE_DOWN (cnc_z-7)
+#define Z_VALUE_MID (cnc_z-3*NM_PER_MM)
+#define Z_VALUE_DOWN (cnc_z-7*NM_PER_MM)
 
 #define FEEDRATE_HIGH 400
 #define FEEDRATE_LOW 30
 
+// default peck depth (mm) of the G83 drill cycle
+#define PECK_DEPTH 1.0
+
+// default max. distance (mm) between holes for moving at the mid plane
+#define HOP_DISTANCE 3.0
+
+// max. speed (mm/min) and acceleration (mm/s^2) of the X and Y axis,
+// used by the "time" travel cost model of the path optimizer
+#define AXIS_SPEED_X 400
+#define AXIS_SPEED_Y 400
+#define AXIS_ACCEL_X 50
+#define AXIS_ACCEL_Y 50
+
+// default time budget of the drilling path optimizer (ms)
+#define OPT_TIME_BUDGET 2000
+
+// output buffer for generating a G-code file (-g)
+#define GCODE_OUT_BUFSIZE (1 << 20)
+
+// max. zoom of the view (pixels per mm), min. radius and spacing (pixels) for
+// drawing holes as circles instead of a heatmap
+#define VIEW_MAX_SCALE 200
+#define VIEW_CIRCLE_RADIUS 2
+#define VIEW_CIRCLE_SPACING 10
+
+// max. distance (mm) of a calibration point from the fit to count as inlier
+#define ADJUST_TOLERANCE 0.2
+
+// up to this many calibration points all triples are tried, random ones otherwise
+#define ADJUST_RANSAC_ALL 30
+#define ADJUST_RANSAC_ITERATIONS 5000
+
+// max. number of tools in a drill file
+#define MAX_TOOLS 100
+
+// time for a manual tool change (s), for the job time estimate
+#define TOOL_CHANGE_TIME 30
+
+// max. number of tools that are scheduled exactly (slower for more)
+#define SCHEDULE_EXACT_TOOLS 12
+
+// G-code used for drilling a hole (-d)
+#define DRILL_CYCLE_LEGACY 0	// separate Z moves with redundant up moves
+#define DRILL_CYCLE_EXPAND 1	// XY, Z mid, Z down, Z up
+#define DRILL_CYCLE_G81 2	// one canned cycle line per hole
+#define DRILL_CYCLE_G83 3	// one canned peck cycle line per hole
+
+// drilling order modes (-o)
+#define ORDER_MORTON 0
+#define ORDER_HILBERT 1
+#define ORDER_OPTIMIZED 2
+
+// size of the neighbor lists used by the path optimizer
+#define TSP_NEIGHBORS 8
+
+// max. number of unacknowledged lines and markers in streaming mode (-s)
+#define GCODE_INFLIGHT_MAX 256
+
+// max. RX buffer size for -s (larger buffers are limited by GCODE_INFLIGHT_MAX)
+#define GCODE_RXBUF_MAX 1024
+
+// size of the queues between GUI and serial thread
+#define GCODE_QUEUE_SIZE 256
+
+// max. number of queued G-code lines while drilling (abort drops these)
+#define GCODE_QUEUE_AHEAD 32
+
+// max. time (ms) to wait for the CNC to acknowledge the last lines when quitting
+#define GCODE_QUIT_TIMEOUT 5000
+
 #ifdef WIN32
 #  define TTS_FOR_GCODE "COM3"
 #else
@@ -33,15 +117,30 @@
 
 #define CONSIZE 45
 int console_gui = 0;
+int console_stderr = 0;
 char conbuffer[CONSIZE][128] = { };
 int conbuffer_i = 0;
 
-#define console(fmt, ...) do { printf(fmt, ##__VA_ARGS__); fflush(stdout); \
+#define console(fmt, ...) do { FILE *_cf = console_stderr ? stderr : stdout; \
+  fprintf(_cf, fmt, ##__VA_ARGS__); fflush(_cf); \
   if (console_gui) { snprintf(conbuffer[conbuffer_i], 128, "%s" fmt, conbuffer[conbuffer_i], ##__VA_ARGS__); \
   int len = strlen(conbuffer[conbuffer_i]); screen_needs_update = 1; \
   if (len > 0 && conbuffer[conbuffer_i][len-1] == '\n') { conbuffer_i = (conbuffer_i+1) % CONSIZE; \
   conbuffer[conbuffer_i][0] = 0; } } } while (0)
 
+// per move messages, only printed with -v when generating a G-code file
+#define console_move(fmt, ...) do { if (!blind_gcode_mode || verbose) \
+  console(fmt, ##__VA_ARGS__); } while (0)
+
+// messages of a batch job, a worker thread collects them for the main thread
+__thread FILE *console_job_buffer;
+#define console_job(fmt, ...) do { if (console_job_buffer) \
+  fprintf(console_job_buffer, fmt, ##__VA_ARGS__); else console(fmt, ##__VA_ARGS__); } while (0)
+
+// planning messages, only printed with -v in batch mode
+#define console_plan(fmt, ...) do { if (!batch_mode || verbose) \
+  console_job(fmt, ##__VA_ARGS__); } while (0)
+
 // This is to not confuse the VIM syntax highlighting
 #define CHECK_VAL_OPEN (
 #define CHECK_VAL_CLOSE )
@@ -63,45 +162,82 @@ const char *tts_device = TTS_FOR_GCODE;
 float min_x, max_x;
 float min_y, max_y;
 
-struct pos {
-	struct pos *next;
-	float x, y;
-	int done;
+struct tool_info {
+	int number;		// T number in the drill file
+	float diameter;		// mm
+	int first, count;	// range of the tool's holes in the drilling sequence
+	float plunge_feed;	// mm/min, from the tool profiles
+	float retract_feed;	// mm/min, from the tool profiles
 };
 
-struct pos *drill_list = NULL;
-struct pos *mark_list = NULL;
-struct pos *mount_list = NULL;
+/*
+ * Feed profiles per bit size, loaded from metadrill.tools: one line per
+ * profile with the max. diameter (mm), the plunge feed and the retract
+ * feed (mm/min). Comment lines start with '#'. Tools larger than all
+ * profiles use FEEDRATE_LOW and FEEDRATE_HIGH.
+ */
+struct tool_profile {
+	float max_diameter;
+	float plunge_feed, retract_feed;
+};
 
-int mark_count = 0;
-int mount_count = 0;
-int drill_count = 0;
+struct tool_profile tool_profiles[MAX_TOOLS];
+int tool_profile_count;
 
-struct matrixop {
-	float a, b, c, d, e, f;
+/*
+ * All holes of the drill file, stored as a structure of arrays carved
+ * from a single allocation (the arena). The drilling sequence is a
+ * permutation of the hole indices, grouped by tool.
+ */
+struct hole_table {
+	int count, capacity;
+	float min_x, max_x;
+	float min_y, max_y;
+	void *arena;
+	int64_t *nx, *ny;	// exact board coordinates (nm) from the drill file
+	int64_t *mx, *my;	// machine coordinates (nm), see hole_table_transform()
+	float *x, *y;		// board coordinates (mm) for the planner and the screen
+	int *tool;		// index into tools[]
+	int *order;
+	uint32_t *done;		// bitset
+	int order_count;
+	struct tool_info tools[MAX_TOOLS];
+	int tool_count;
 };
 
-struct transform_job {
-	// output:
-	float xp, yp;
-	// input:
-	float xf, yf;
-	struct matrixop op;
-};
+struct hole_table holes;
+int drill_tool, drill_next;
+int gcode_tool = -1;
+char drill_prompt[128];
 
-struct adjust_job {
-	// input:
-	float xp[3], yp[3];
-	float xf[3], yf[3];
-	// output:
-	struct matrixop op;
+struct matrixop {
+	double a, b, c, d, e, f;
 };
 
 struct matrixop active_matrixop;
 
+/*
+ * Optional non-linear correction on top of the transformation matrix
+ * (-P): a polynomial of the given degree in the board coordinates, only
+ * the terms of degree 2 and up (the lower ones are in the matrix). The
+ * board coordinates are normalized with (x-cx)/scale, (y-cy)/scale.
+ * Stored in metadrill.cor next to metadrill.mat.
+ */
+#define CORRECTION_MAX_TERMS 7
+
+struct correction {
+	int degree;		// 0 = no correction, 2 or 3
+	double cx, cy, scale;
+	double kx[CORRECTION_MAX_TERMS], ky[CORRECTION_MAX_TERMS];
+};
+
+struct correction active_correction;
+int correction_degree;
+
 struct adjust_sample {
 	struct adjust_sample *next;
 	float xf, yf, xp, yp;
+	int outlier;	// doesn't agree with the other samples
 };
 
 struct adjust_sample *adj_list = NULL;
@@ -114,12 +250,27 @@ int adj_count = 0;
 #define Z_STATE_MID 1
 #define Z_STATE_DOWN 2
 
-float cnc_x, cnc_y, cnc_z;
+int64_t cnc_x, cnc_y, cnc_z;	// nm
 float target_x, target_y;
+int target_hole = -1;
 float current_x, current_y;
 int current_z, current_autopos;
 int drilling, drilling_ok;
-int blind_gcode_mode;
+
+// a key was pressed while drilling, no more holes are queued
+int drill_aborting;
+int blind_gcode_mode;	// no GUI and nobody at the keyboard (-g, -b, -r)
+int stream_mode;	// -r
+int batch_mode;
+int gcode_rxbuf_size;
+int opt_time_budget = OPT_TIME_BUDGET;
+int order_mode = ORDER_OPTIMIZED;
+int drill_cycle = DRILL_CYCLE_LEGACY;
+float peck_depth = PECK_DEPTH;
+float hop_distance = HOP_DISTANCE;
+int hop_count;
+int gcode_cycle_active;
+int verbose;
 
 float manual_step_size;
 int manual_step_index;
@@ -128,295 +279,2431 @@ SDL_Surface *screen;
 TTF_Font *font, *tiny_font;
 
 int screen_needs_update = 1;
+int hole_layer_valid;	// see hole_layer_draw()
 
-int get_morton_num(int v1, int v2);
-int compare_pos_by_morton_num(const void *a_vp, const void *b_vp);
-void read_drlfile(FILE *f);
+void read_drlfile(const char *filename);
 void set_default_matrixop(struct matrixop *op);
 void print_matrixop(struct matrixop *op);
-void transform(struct transform_job *job);
-void adjust(struct adjust_job *job);
 int get_screen_x(float x);
 int get_screen_y(float y);
+void view_reset();
 void setpixel(int x, int y, int r, int g, int b);
 void draw_screen();
 void draw_move_line(float x1f, float y1f, float x2f, float y2f);
-void move_cnc_head(float x, float y, int z);
+void move_cnc_head(float x, float y, int i, int z);
+void gcode_poll();
+void drill_marker_reached(int tag);
+void drill_aborted();
 
-int get_morton_num(int v1, int v2)
+double get_time()
 {
-	int i, retval = 0;
+#ifdef WIN32
+	return GetTickCount() / 1000.0;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+static inline double nm_to_mm(int64_t v)
+{
+	return v * (1.0 / NM_PER_MM);
+}
+
+static inline int64_t mm_to_nm(double v)
+{
+	return llround(v * NM_PER_MM);
+}
+
+/*
+ * Format v nm as mm with 6 decimals, like "%f" but exact and without
+ * libc. Returns the end of the string.
+ */
+char *format_nm(char *p, int64_t v)
+{
+	uint64_t u = v < 0 ? -(uint64_t)v : (uint64_t)v;
+	char tmp[24];
+	int n = 0;
 
-	int bit(int v, int in_pos, int out_pos) {
-		return ((v >> in_pos) & 1) << out_pos;
+	if (v < 0)
+		*p++ = '-';
+	do {
+		tmp[n++] = '0' + u % 10;
+		u /= 10;
+	} while (u || n < 7);
+	while (n > 6)
+		*p++ = tmp[--n];
+	*p++ = '.';
+	while (n > 0)
+		*p++ = tmp[--n];
+	*p = 0;
+	return p;
+}
+
+// append the G-code word " <letter><v in mm>" to a line
+char *gcode_word(char *p, char letter, int64_t v)
+{
+	*p++ = ' ';
+	*p++ = letter;
+	return format_nm(p, v);
+}
+
+void hole_table_grow(struct hole_table *h, int capacity)
+{
+	int done_words = (capacity + 31) / 32;
+	char *arena = calloc(1, capacity * (4*sizeof(int64_t) + 2*sizeof(float) + 2*sizeof(int)) +
+			done_words * sizeof(uint32_t));
+	struct hole_table n = *h;
+
+	n.capacity = capacity;
+	n.arena = arena;
+
+	n.nx = (int64_t*)arena;
+	n.ny = n.nx + capacity;
+	n.mx = n.ny + capacity;
+	n.my = n.mx + capacity;
+	n.x = (float*)(n.my + capacity);
+	n.y = n.x + capacity;
+	n.tool = (int*)(n.y + capacity);
+	n.order = n.tool + capacity;
+	n.done = (uint32_t*)(n.order + capacity);
+
+	if (h->arena) {
+		memcpy(n.nx, h->nx, h->count * sizeof(int64_t));
+		memcpy(n.ny, h->ny, h->count * sizeof(int64_t));
+		memcpy(n.x, h->x, h->count * sizeof(float));
+		memcpy(n.y, h->y, h->count * sizeof(float));
+		memcpy(n.tool, h->tool, h->count * sizeof(int));
+		memcpy(n.order, h->order, h->order_count * sizeof(int));
+		memcpy(n.done, h->done, (h->capacity + 31) / 32 * sizeof(uint32_t));
+		free(h->arena);
 	}
 
-	for (i=0; i<16; i++) {
-		retval |= bit(v1, i, 2*i);
-		retval |= bit(v2, i, 2*i+1);
+	*h = n;
+}
+
+int hole_table_add(struct hole_table *h, int64_t x, int64_t y, int tool)
+{
+	if (h->count == h->capacity)
+		hole_table_grow(h, h->capacity ? 2*h->capacity : 1024);
+	h->nx[h->count] = x;
+	h->ny[h->count] = y;
+	h->x[h->count] = nm_to_mm(x);
+	h->y[h->count] = nm_to_mm(y);
+	h->tool[h->count] = tool;
+	h->order[h->order_count++] = h->count;
+	return h->count++;
+}
+
+// index of the tool with the given T number, added if not known yet
+int hole_table_tool(struct hole_table *h, int number)
+{
+	int i;
+	for (i=0; i<h->tool_count; i++)
+		if (h->tools[i].number == number)
+			return i;
+	if (h->tool_count == MAX_TOOLS)
+		return -1;
+	h->tools[i].number = number;
+	h->tools[i].diameter = 0;
+	return h->tool_count++;
+}
+
+void load_tool_profiles(const char *filename)
+{
+	char line[256];
+	FILE *f;
+
+	if ((f = fopen(filename, "r")) == NULL)
+		return;
+	while (fgets(line, sizeof(line), f) != NULL && tool_profile_count < MAX_TOOLS) {
+		struct tool_profile p;
+		if (line[0] == '#' || sscanf(line, "%f %f %f", &p.max_diameter,
+				&p.plunge_feed, &p.retract_feed) != 3)
+			continue;
+		// keep the table sorted by diameter
+		int i = tool_profile_count++;
+		for (; i > 0 && tool_profiles[i-1].max_diameter > p.max_diameter; i--)
+			tool_profiles[i] = tool_profiles[i-1];
+		tool_profiles[i] = p;
+	}
+	fclose(f);
+	console("Loaded %d tool profiles from %s.\n", tool_profile_count, filename);
+}
+
+void tool_apply_profile(struct tool_info *t)
+{
+	int i;
+	t->plunge_feed = FEEDRATE_LOW;
+	t->retract_feed = FEEDRATE_HIGH;
+	for (i=0; i<tool_profile_count; i++)
+		if (t->diameter <= tool_profiles[i].max_diameter) {
+			t->plunge_feed = tool_profiles[i].plunge_feed;
+			t->retract_feed = tool_profiles[i].retract_feed;
+			break;
+		}
+}
+
+// sort the drilling sequence by tool (stable) and set up the tool ranges
+void hole_table_group_by_tool(struct hole_table *h)
+{
+	int *order = malloc(sizeof(int)*h->order_count);
+	int i, pos = 0;
+
+	for (i=0; i<h->tool_count; i++)
+		h->tools[i].count = 0;
+	for (i=0; i<h->order_count; i++)
+		h->tools[h->tool[h->order[i]]].count++;
+	for (i=0; i<h->tool_count; i++) {
+		h->tools[i].first = pos;
+		pos += h->tools[i].count;
+		h->tools[i].count = 0;
+	}
+	for (i=0; i<h->order_count; i++) {
+		struct tool_info *t = &h->tools[h->tool[h->order[i]]];
+		order[t->first + t->count++] = h->order[i];
+	}
+
+	memcpy(h->order, order, sizeof(int)*h->order_count);
+	free(order);
+}
+
+int hole_is_done(struct hole_table *h, int i)
+{
+	return (h->done[i / 32] >> (i % 32)) & 1;
+}
+
+void hole_set_done(struct hole_table *h, int i)
+{
+	h->done[i / 32] |= 1u << (i % 32);
+}
+
+/*
+ * Spatial sort keys: the coordinates are quantized to 32 bits over the
+ * bounding box of the board and interleaved to a 64 bit Morton (Z-order)
+ * number. The keys are computed once per hole and sorted with an LSD
+ * radix sort.
+ */
+uint64_t morton_spread_table[256];
+
+void init_morton_spread_table()
+{
+	int i, j;
+	for (i=0; i<256; i++) {
+		morton_spread_table[i] = 0;
+		for (j=0; j<8; j++)
+			morton_spread_table[i] |= (uint64_t)((i >> j) & 1) << (2*j);
+	}
+}
+
+uint64_t morton_spread(uint32_t v)
+{
+#ifdef __BMI2__
+	return _pdep_u64(v, 0x5555555555555555ULL);
+#else
+	return morton_spread_table[v & 0xff] |
+			morton_spread_table[(v >> 8) & 0xff] << 16 |
+			morton_spread_table[(v >> 16) & 0xff] << 32 |
+			morton_spread_table[v >> 24] << 48;
+#endif
+}
+
+uint64_t get_morton_key(uint32_t x, uint32_t y)
+{
+	return morton_spread(x) | morton_spread(y) << 1;
+}
+
+/*
+ * Position along a Hilbert curve through the 2^32 x 2^32 grid. Unlike the
+ * Morton order the curve never jumps, consecutive keys are always
+ * neighboring grid cells.
+ */
+uint64_t get_hilbert_key(uint32_t x, uint32_t y)
+{
+	uint64_t d = 0;
+	uint32_t s;
+
+	for (s=1u<<31; s>0; s>>=1) {
+		uint32_t rx = (x & s) > 0;
+		uint32_t ry = (y & s) > 0;
+		d += (uint64_t)s * s * ((3 * rx) ^ ry);
+		if (ry == 0) {
+			if (rx == 1) {
+				x = ~x;
+				y = ~y;
+			}
+			uint32_t t = x;
+			x = y;
+			y = t;
+		}
+	}
+
+	return d;
+}
+
+uint32_t quantize_coord(float v, float min_v, float max_v)
+{
+	if (max_v <= min_v)
+		return 0;
+	return (v - min_v) / ((double)max_v - min_v) * 4294967295.0;
+}
+
+// sort keys[] and the payload idx[] by keys[] (8 passes of 8 bits, passes with only one bucket are skipped)
+void radix_sort_keys(uint64_t *keys, int *idx, int n)
+{
+	uint64_t *tmp_keys = malloc(sizeof(uint64_t)*n), *src_keys = keys, *dst_keys = tmp_keys;
+	int *tmp_idx = malloc(sizeof(int)*n), *src_idx = idx, *dst_idx = tmp_idx;
+	int count[8][256] = { };
+	int shift, i;
+
+	for (i=0; i<n; i++)
+		for (shift=0; shift<8; shift++)
+			count[shift][(keys[i] >> (8*shift)) & 0xff]++;
+
+	for (shift=0; shift<8; shift++) {
+		int *c = count[shift], sum = 0;
+		if (n == 0 || c[(keys[0] >> (8*shift)) & 0xff] == n)
+			continue;
+		for (i=0; i<256; i++) {
+			int tmp = c[i];
+			c[i] = sum;
+			sum += tmp;
+		}
+		for (i=0; i<n; i++) {
+			int j = c[(src_keys[i] >> (8*shift)) & 0xff]++;
+			dst_keys[j] = src_keys[i];
+			dst_idx[j] = src_idx[i];
+		}
+		uint64_t *tk = src_keys; src_keys = dst_keys; dst_keys = tk;
+		int *ti = src_idx; src_idx = dst_idx; dst_idx = ti;
+	}
+
+	if (src_keys != keys) {
+		memcpy(keys, src_keys, sizeof(uint64_t)*n);
+		memcpy(idx, src_idx, sizeof(int)*n);
+	}
+
+	free(tmp_keys);
+	free(tmp_idx);
+}
+
+void sort_drill_list_by_key(struct hole_table *h, uint64_t (*get_key)(uint32_t x, uint32_t y))
+{
+	uint64_t *keys = malloc(sizeof(uint64_t)*h->order_count);
+	int i;
+
+	for (i=0; i<h->order_count; i++) {
+		int j = h->order[i];
+		keys[i] = get_key(quantize_coord(h->x[j], h->min_x, h->max_x),
+				quantize_coord(h->y[j], h->min_y, h->max_y));
+	}
+
+	for (i=0; i<h->tool_count; i++) {
+		struct tool_info *t = &h->tools[i];
+		radix_sort_keys(keys + t->first, h->order + t->first, t->count);
 	}
 
+	free(keys);
+}
+
+void sort_drill_list_by_morton_num(struct hole_table *h)
+{
+	sort_drill_list_by_key(h, get_morton_key);
+}
+
+void sort_drill_list_by_hilbert_num(struct hole_table *h)
+{
+	sort_drill_list_by_key(h, get_hilbert_key);
+}
+
+/*
+ * Microbenchmark (-B): sorting n random holes by Morton order, the old way
+ * (qsort, key computed from screen coordinates with a bit loop in every
+ * comparison) and with precomputed keys and radix sort.
+ */
+static float *benchmark_x, *benchmark_y;
+
+static int benchmark_old_morton_num(int v1, int v2)
+{
+	int i, retval = 0;
+	for (i=0; i<16; i++) {
+		retval |= ((v1 >> i) & 1) << (2*i);
+		retval |= ((v2 >> i) & 1) << (2*i+1);
+	}
 	return retval;
 }
 
-int compare_pos_by_morton_num(const void *a_vp, const void *b_vp)
+static int benchmark_old_compare(const void *a_vp, const void *b_vp)
+{
+	const int *a = a_vp, *b = b_vp;
+	int a_mn = benchmark_old_morton_num(get_screen_x(benchmark_x[*a]), get_screen_y(benchmark_y[*a]));
+	int b_mn = benchmark_old_morton_num(get_screen_x(benchmark_x[*b]), get_screen_y(benchmark_y[*b]));
+	return a_mn < b_mn ? -1 : a_mn > b_mn;
+}
+
+void benchmark_sort(int n)
+{
+	float *x = malloc(sizeof(float)*n), *y = malloc(sizeof(float)*n);
+	uint64_t *keys = malloc(sizeof(uint64_t)*n);
+	int *idx = malloc(sizeof(int)*n);
+	double t;
+	int i;
+
+	min_x = min_y = 0;
+	max_x = max_y = 300;
+	srand(1);
+	for (i=0; i<n; i++) {
+		x[i] = rand() * 300.0 / RAND_MAX;
+		y[i] = rand() * 300.0 / RAND_MAX;
+	}
+
+	for (i=0; i<n; i++)
+		idx[i] = i;
+	t = get_time();
+	benchmark_x = x;
+	benchmark_y = y;
+	qsort(idx, n, sizeof(int), benchmark_old_compare);
+	printf("Sorting %d holes, qsort + per comparison keys: %8.2f ms\n", n, (get_time() - t) * 1000);
+
+	for (i=0; i<n; i++)
+		idx[i] = i;
+	t = get_time();
+	for (i=0; i<n; i++)
+		keys[i] = get_morton_key(quantize_coord(x[i], min_x, max_x),
+				quantize_coord(y[i], min_y, max_y));
+	radix_sort_keys(keys, idx, n);
+	printf("Sorting %d holes, precomputed keys + radix sort: %8.2f ms\n", n, (get_time() - t) * 1000);
+
+	for (i=1; i<n; i++)
+		CHECK(keys[i-1] <= keys[i], != 0);
+
+	free(x);
+	free(y);
+	free(keys);
+	free(idx);
+}
+
+/*
+ * Uniform grid over a set of points (CSR layout: the points of cell c are
+ * items[cell_start[c]] .. items[cell_start[c+1]-1]).
+ */
+struct hole_grid {
+	float min_x, min_y, cell_size;
+	int w, h;
+	int *cell_start;
+	int *items;
+};
+
+int hole_grid_cell(struct hole_grid *g, float x, float y, int *cx, int *cy)
+{
+	*cx = (x - g->min_x) / g->cell_size;
+	*cy = (y - g->min_y) / g->cell_size;
+	if (*cx < 0) *cx = 0;
+	if (*cx >= g->w) *cx = g->w-1;
+	if (*cy < 0) *cy = 0;
+	if (*cy >= g->h) *cy = g->h-1;
+	return *cx + *cy * g->w;
+}
+
+void hole_grid_build(struct hole_grid *g, const float *x, const float *y, int n)
+{
+	float max_x, max_y;
+	int i, cx, cy;
+
+	g->min_x = max_x = n ? x[0] : 0;
+	g->min_y = max_y = n ? y[0] : 0;
+	for (i=1; i<n; i++) {
+		if (x[i] < g->min_x) g->min_x = x[i];
+		if (x[i] > max_x) max_x = x[i];
+		if (y[i] < g->min_y) g->min_y = y[i];
+		if (y[i] > max_y) max_y = y[i];
+	}
+
+	// about two points per cell (also for points on a line)
+	g->cell_size = sqrt((max_x-g->min_x) * (max_y-g->min_y) / (n/2 + 1));
+	if (g->cell_size < (max_x-g->min_x + max_y-g->min_y) / (n/2 + 1))
+		g->cell_size = (max_x-g->min_x + max_y-g->min_y) / (n/2 + 1);
+	if (g->cell_size < (max_x-g->min_x) / 1024)
+		g->cell_size = (max_x-g->min_x) / 1024;
+	if (g->cell_size < (max_y-g->min_y) / 1024)
+		g->cell_size = (max_y-g->min_y) / 1024;
+	if (g->cell_size <= 0)
+		g->cell_size = 1;
+	g->w = (max_x-g->min_x) / g->cell_size + 1;
+	g->h = (max_y-g->min_y) / g->cell_size + 1;
+
+	g->cell_start = calloc(g->w*g->h + 1, sizeof(int));
+	g->items = malloc(sizeof(int)*n);
+	for (i=0; i<n; i++)
+		g->cell_start[hole_grid_cell(g, x[i], y[i], &cx, &cy) + 1]++;
+	for (i=0; i<g->w*g->h; i++)
+		g->cell_start[i+1] += g->cell_start[i];
+	int *fill = malloc(sizeof(int)*g->w*g->h);
+	memcpy(fill, g->cell_start, sizeof(int)*g->w*g->h);
+	for (i=0; i<n; i++)
+		g->items[fill[hole_grid_cell(g, x[i], y[i], &cx, &cy)]++] = i;
+	free(fill);
+}
+
+void hole_grid_free(struct hole_grid *g)
+{
+	free(g->cell_start);
+	free(g->items);
+}
+
+/*
+ * Find the k nearest neighbors of point i (sorted by distance). Returns
+ * the number of neighbors found.
+ */
+int hole_grid_knn(struct hole_grid *g, const float *x, const float *y, int i, int k, int *out)
+{
+	float out_d[k];
+	int found = 0, r, cx, cy, j;
+
+	hole_grid_cell(g, x[i], y[i], &cx, &cy);
+
+	for (r=0; r < g->w || r < g->h; r++) {
+		int gx, gy;
+		for (gy=cy-r; gy<=cy+r; gy++)
+		for (gx=cx-r; gx<=cx+r; gx++) {
+			if (gx < 0 || gy < 0 || gx >= g->w || gy >= g->h)
+				continue;
+			if (gx != cx-r && gx != cx+r && gy != cy-r && gy != cy+r)
+				continue;
+			int c = gx + gy*g->w;
+			for (j=g->cell_start[c]; j<g->cell_start[c+1]; j++) {
+				int p = g->items[j];
+				if (p == i)
+					continue;
+				float dx = x[p]-x[i], dy = y[p]-y[i];
+				float d = dx*dx + dy*dy;
+				if (found == k && d >= out_d[k-1])
+					continue;
+				int pos = found < k ? found++ : k-1;
+				while (pos > 0 && out_d[pos-1] > d) {
+					out_d[pos] = out_d[pos-1];
+					out[pos] = out[pos-1];
+					pos--;
+				}
+				out_d[pos] = d;
+				out[pos] = p;
+			}
+		}
+		if (found == k && out_d[k-1] <= (r*g->cell_size)*(r*g->cell_size))
+			break;
+	}
+
+	return found;
+}
+
+/*
+ * Find the point nearest to (px, py) that accept(p, arg) agrees to (any
+ * point if accept is NULL), with the distances measured after scaling x by sx and y by sy (e.g. screen
+ * pixels) and only up to max_dist (INFINITY for no limit). Returns -1
+ * if there is none.
+ */
+int hole_grid_nearest(struct hole_grid *g, const float *x, const float *y, float px, float py,
+		float sx, float sy, float max_dist, int (*accept)(int p, void *arg), void *arg)
+{
+	float best_d = max_dist*max_dist, min_scale = sx < sy ? sx : sy;
+	int best = -1, r, cx, cy, j;
+
+	hole_grid_cell(g, px, py, &cx, &cy);
+
+	for (r=0; r < g->w || r < g->h; r++) {
+		int gx, gy;
+		for (gy=cy-r; gy<=cy+r; gy++)
+		for (gx=cx-r; gx<=cx+r; gx++) {
+			if (gx < 0 || gy < 0 || gx >= g->w || gy >= g->h)
+				continue;
+			if (gx != cx-r && gx != cx+r && gy != cy-r && gy != cy+r)
+				continue;
+			int c = gx + gy*g->w;
+			for (j=g->cell_start[c]; j<g->cell_start[c+1]; j++) {
+				int p = g->items[j];
+				float dx = (x[p]-px)*sx, dy = (y[p]-py)*sy;
+				float d = dx*dx + dy*dy;
+				if (d < best_d && (!accept || accept(p, arg))) {
+					best = p;
+					best_d = d;
+				}
+			}
+		}
+		// all points in the next rings are at least r cells away
+		float ring_d = r * g->cell_size * min_scale;
+		if (ring_d*ring_d >= best_d)
+			break;
+	}
+
+	return best;
+}
+
+/*
+ * Travel cost models for the path optimizer. The cost functions get the
+ * move in machine coordinates (mm), i.e. after applying the linear part of
+ * the transformation matrix.
+ */
+struct travel_model {
+	const char *name, *unit;
+	double (*cost)(double mx, double my);
+};
+
+double travel_cost_euclid(double mx, double my)
+{
+	return sqrt(mx*mx + my*my);
+}
+
+// X and Y move independently, the longer axis determines the time
+double travel_cost_chebyshev(double mx, double my)
+{
+	return fmax(fabs(mx), fabs(my));
+}
+
+// time for a move of d mm with a trapezoidal velocity profile
+double axis_move_time(double d, double speed, double accel)
+{
+	double v = speed / 60;
+	d = fabs(d);
+	if (d < v*v / accel)
+		return 2 * sqrt(d / accel);
+	return d / v + v / accel;
+}
+
+double travel_cost_time(double mx, double my)
+{
+	return fmax(axis_move_time(mx, AXIS_SPEED_X, AXIS_ACCEL_X),
+			axis_move_time(my, AXIS_SPEED_Y, AXIS_ACCEL_Y));
+}
+
+struct travel_model travel_models[] = {
+	{ "time", "s", travel_cost_time },
+	{ "chebyshev", "mm", travel_cost_chebyshev },
+	{ "euclid", "mm", travel_cost_euclid },
+	{ }
+};
+
+struct travel_model *travel_model = &travel_models[0];
+
+double travel_cost(float x1, float y1, float x2, float y2)
+{
+	float dx = x2-x1, dy = y2-y1;
+	return travel_model->cost(active_matrixop.a * dx + active_matrixop.c * dy,
+			active_matrixop.b * dx + active_matrixop.d * dy);
+}
+
+/*
+ * Path optimizer for the drilling sequence: nearest neighbor construction
+ * followed by 2-opt and Or-opt improvement (using neighbor lists) until
+ * no improving move is left or the time budget is used up.
+ *
+ * The open path is stored as a cycle with an additional dummy node (index
+ * n) that has zero distance to all other nodes, so the moves can change
+ * the start and end point of the path too.
+ */
+struct tsp_job {
+	int n;
+	const float *x, *y;
+	double (*cost)(float x1, float y1, float x2, float y2);
+	int *tour;	// position -> node (n+1 entries)
+	int *pos;	// node -> position
+	int *neigh;	// TSP_NEIGHBORS entries per node
+	int *neigh_count;
+};
+
+double tsp_dist(struct tsp_job *t, int a, int b)
+{
+	if (a == t->n || b == t->n)
+		return 0;
+	return t->cost(t->x[a], t->y[a], t->x[b], t->y[b]);
+}
+
+int tsp_succ(struct tsp_job *t, int a)
+{
+	return t->tour[(t->pos[a]+1) % (t->n+1)];
+}
+
+int tsp_pred(struct tsp_job *t, int a)
+{
+	return t->tour[(t->pos[a]+t->n) % (t->n+1)];
+}
+
+// reverse the tour between the positions i and j (inclusive, wrapping around)
+void tsp_reverse(struct tsp_job *t, int i, int j)
+{
+	int N = t->n+1;
+	int len = (j-i+N) % N + 1;
+
+	// reversing the complement gives the same cycle
+	if (2*len > N) {
+		int k = i;
+		i = (j+1) % N;
+		j = (k+N-1) % N;
+		len = N - len;
+	}
+
+	for (; len > 1; len -= 2) {
+		int a = t->tour[i], b = t->tour[j];
+		t->tour[i] = b;
+		t->pos[b] = i;
+		t->tour[j] = a;
+		t->pos[a] = j;
+		i = (i+1) % N;
+		j = (j+N-1) % N;
+	}
+}
+
+// replace the edges (a,b) and (c,d) with (a,c) and (b,d)
+void tsp_move_2opt(struct tsp_job *t, int a, int b, int c, int d)
+{
+	if (tsp_succ(t, a) == b)
+		tsp_reverse(t, t->pos[b], t->pos[c]);
+	else
+		tsp_reverse(t, t->pos[c], t->pos[b]);
+}
+
+int tsp_improve_2opt(struct tsp_job *t, int a)
+{
+	int dir, k;
+
+	for (dir=0; dir<2; dir++) {
+		int b = dir ? tsp_pred(t, a) : tsp_succ(t, a);
+		double d_ab = tsp_dist(t, a, b);
+		for (k=0; k<t->neigh_count[a]; k++) {
+			int c = t->neigh[a*TSP_NEIGHBORS + k];
+			double g1 = d_ab - tsp_dist(t, a, c);
+			if (g1 <= 0)
+				break;
+			int d = dir ? tsp_pred(t, c) : tsp_succ(t, c);
+			if (c == b || d == a)
+				continue;
+			if (g1 + tsp_dist(t, c, d) - tsp_dist(t, b, d) > 1e-6) {
+				tsp_move_2opt(t, a, b, c, d);
+				return 1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+// move a segment of 1-3 nodes starting at s1 to a position next to one of its neighbors
+int tsp_improve_oropt(struct tsp_job *t, int s1)
+{
+	int len, k, e, rev;
+
+	for (len=1; len<=3 && len < t->n-1; len++) {
+		int s2 = s1, i;
+		for (i=1; i<len; i++)
+			s2 = tsp_succ(t, s2);
+		if (s2 == t->n)
+			break;
+		int p = tsp_pred(t, s1), n = tsp_succ(t, s2);
+		double g1 = tsp_dist(t, p, s1) + tsp_dist(t, s2, n) - tsp_dist(t, p, n);
+		if (g1 <= 1e-6)
+			continue;
+
+		for (e=0; e<2; e++)
+		for (k=0; k<t->neigh_count[e ? s2 : s1]; k++) {
+			int c0 = t->neigh[(e ? s2 : s1)*TSP_NEIGHBORS + k];
+			if (tsp_dist(t, c0, e ? s2 : s1) >= g1)
+				break;
+			for (i=0; i<2; i++) {
+				int c = i ? tsp_pred(t, c0) : c0;
+				int d = tsp_succ(t, c);
+				int s, in_seg = 0;
+				for (s=s1; ; s=tsp_succ(t, s)) {
+					if (s == c || s == d)
+						in_seg = 1;
+					if (s == s2)
+						break;
+				}
+				if (in_seg || c == n || d == p)
+					continue;
+				double fwd = tsp_dist(t, c, s1) + tsp_dist(t, s2, d);
+				double bwd = tsp_dist(t, c, s2) + tsp_dist(t, s1, d);
+				rev = bwd < fwd;
+				if (g1 - (rev ? bwd : fwd) + tsp_dist(t, c, d) <= 1e-6)
+					continue;
+				tsp_move_2opt(t, p, s1, c, d);
+				tsp_move_2opt(t, p, c, n, s2);
+				if (!rev)
+					tsp_move_2opt(t, c, s2, s1, d);
+				return 1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+double tsp_length(struct tsp_job *t)
+{
+	double len = 0;
+	int i;
+	for (i=0; i<=t->n; i++)
+		len += tsp_dist(t, t->tour[i], t->tour[(i+1) % (t->n+1)]);
+	return len;
+}
+
+/*
+ * Optimize the order of the n points for the given travel cost function.
+ * The path starts near (start_x, start_y). On return order[] holds the
+ * point indices in drilling order.
+ */
+void tsp_optimize(const float *x, const float *y, int n, float start_x, float start_y,
+		int *order, double time_budget, double (*cost)(float x1, float y1, float x2, float y2))
+{
+	double t_start = get_time();
+	struct tsp_job t = { n, x, y, cost };
+	struct hole_grid g;
+	int i, j;
+
+	if (n < 3) {
+		for (i=0; i<n; i++)
+			order[i] = i;
+		return;
+	}
+
+	t.tour = malloc(sizeof(int)*(n+1));
+	t.pos = malloc(sizeof(int)*(n+1));
+	t.neigh = malloc(sizeof(int)*n*TSP_NEIGHBORS);
+	t.neigh_count = malloc(sizeof(int)*n);
+
+	// neighbor lists: geometric neighbors, sorted by travel cost
+	hole_grid_build(&g, x, y, n);
+	for (i=0; i<n; i++) {
+		int *nb = &t.neigh[i*TSP_NEIGHBORS], k, l;
+		t.neigh_count[i] = hole_grid_knn(&g, x, y, i, TSP_NEIGHBORS, nb);
+		for (k=1; k<t.neigh_count[i]; k++)
+			for (l=k; l>0 && tsp_dist(&t, i, nb[l]) < tsp_dist(&t, i, nb[l-1]); l--) {
+				int tmp = nb[l];
+				nb[l] = nb[l-1];
+				nb[l-1] = tmp;
+			}
+	}
+
+	/* nearest neighbor construction: the points still to be visited
+	 * are kept at the front of each grid cell */
+	int *cell_alive = malloc(sizeof(int)*g.w*g.h);
+	int *where = malloc(sizeof(int)*n);
+	for (i=0; i<g.w*g.h; i++)
+		cell_alive[i] = g.cell_start[i+1] - g.cell_start[i];
+	for (i=0; i<n; i++)
+		where[g.items[i]] = i;
+
+	float cur_x = start_x, cur_y = start_y;
+	t.tour[0] = n;
+	for (i=1; i<=n; i++) {
+		int cx, cy, r, best = -1;
+		float best_d = 0;
+		hole_grid_cell(&g, cur_x, cur_y, &cx, &cy);
+		for (r=0; r < g.w || r < g.h; r++) {
+			int gx, gy;
+			for (gy=cy-r; gy<=cy+r; gy++)
+			for (gx=cx-r; gx<=cx+r; gx++) {
+				if (gx < 0 || gy < 0 || gx >= g.w || gy >= g.h)
+					continue;
+				if (gx != cx-r && gx != cx+r && gy != cy-r && gy != cy+r)
+					continue;
+				int c = gx + gy*g.w;
+				for (j=g.cell_start[c]; j<g.cell_start[c]+cell_alive[c]; j++) {
+					int p = g.items[j];
+					float dx = x[p]-cur_x, dy = y[p]-cur_y;
+					float d = dx*dx + dy*dy;
+					if (best < 0 || d < best_d) {
+						best = p;
+						best_d = d;
+					}
+				}
+			}
+			if (best >= 0 && best_d <= (r*g.cell_size)*(r*g.cell_size))
+				break;
+		}
+
+		// remove best from its cell
+		int c = hole_grid_cell(&g, x[best], y[best], &cx, &cy);
+		int last = g.cell_start[c] + --cell_alive[c];
+		int other = g.items[last];
+		g.items[where[best]] = other;
+		where[other] = where[best];
+		g.items[last] = best;
+		where[best] = last;
+
+		t.tour[i] = best;
+		cur_x = x[best];
+		cur_y = y[best];
+	}
+	free(cell_alive);
+	free(where);
+	hole_grid_free(&g);
+
+	for (i=0; i<=n; i++)
+		t.pos[t.tour[i]] = i;
+
+	double nn_len = tsp_length(&t);
+
+	/* local search: queue of nodes with possible improving moves
+	 * ("don't look bits") */
+	int *queue = malloc(sizeof(int)*n);
+	char *queued = malloc(n);
+	int q_first = 0, q_count = n, moves = 0;
+	for (i=0; i<n; i++) {
+		queue[i] = t.tour[i+1];
+		queued[i] = 1;
+	}
+
+	while (q_count > 0) {
+		if ((moves & 63) == 0 && get_time() - t_start > time_budget)
+			break;
+		int a = queue[q_first];
+		int touched[8], touched_n = 0;
+		q_first = (q_first+1) % n;
+		q_count--;
+		queued[a] = 0;
+
+		touched[touched_n++] = tsp_pred(&t, a);
+		touched[touched_n++] = tsp_succ(&t, a);
+		if (!tsp_improve_2opt(&t, a) && !tsp_improve_oropt(&t, a))
+			continue;
+		moves++;
+
+		touched[touched_n++] = a;
+		touched[touched_n++] = tsp_pred(&t, a);
+		touched[touched_n++] = tsp_succ(&t, a);
+		for (j=0; j<touched_n; j++) {
+			int b = touched[j];
+			if (b == n || queued[b])
+				continue;
+			queue[(q_first+q_count++) % n] = b;
+			queued[b] = 1;
+		}
+	}
+	free(queue);
+	free(queued);
+
+	console_plan("Path optimizer: %.2f after nearest neighbor, %.2f after %d moves (%.0f ms%s)\n",
+			nn_len, tsp_length(&t), moves, (get_time() - t_start) * 1000,
+			q_count > 0 ? ", time budget used up" : "");
+
+	// output the path after the dummy node, starting at the end closer to the start position
+	int first = tsp_succ(&t, n), last = tsp_pred(&t, n);
+	float dx1 = x[first]-start_x, dy1 = y[first]-start_y;
+	float dx2 = x[last]-start_x, dy2 = y[last]-start_y;
+	int rev = dx2*dx2 + dy2*dy2 < dx1*dx1 + dy1*dy1;
+	for (i=0; i<n; i++)
+		order[i] = t.tour[(t.pos[n] + (rev ? n+1-(i+1) : i+1)) % (n+1)];
+
+	free(t.tour);
+	free(t.pos);
+	free(t.neigh);
+	free(t.neigh_count);
+}
+
+// result of order_drill_list(), travel in the unit of the travel model
+struct order_stats {
+	double len_morton, len_hilbert;
+	double len;		// of the selected order
+	int hops;		// consecutive holes closer than hop_distance
+	int tool_changes;
+	double time;		// estimated travel and tool change time (s), -1 if unknown
+};
+
+double get_drill_list_length(struct hole_table *h)
+{
+	double len = 0;
+	int i;
+	for (i=1; i<h->order_count; i++) {
+		int a = h->order[i-1], b = h->order[i];
+		len += travel_cost(h->x[a], h->y[a], h->x[b], h->y[b]);
+	}
+	return len;
+}
+
+/*
+ * Tool scheduler: choose the order of the tools and the direction of each
+ * tool's path so that the travel from the start position over all tool
+ * changes is minimal. The paths of the tools are not changed. Exact
+ * (dynamic programming over subsets of tools) for up to
+ * SCHEDULE_EXACT_TOOLS tools, greedy otherwise.
+ */
+void schedule_tools(struct hole_table *h, float start_x, float start_y)
+{
+	int ids[MAX_TOOLS], seq[MAX_TOOLS], seq_dir[MAX_TOOLS];
+	float px[2*MAX_TOOLS], py[2*MAX_TOOLS];	// first and last hole of each tool's path
+	int k = 0, i, j;
+
+	for (i=0; i<h->tool_count; i++) {
+		struct tool_info *t = &h->tools[i];
+		if (t->count == 0)
+			continue;
+		px[2*k] = h->x[h->order[t->first]];
+		py[2*k] = h->y[h->order[t->first]];
+		px[2*k+1] = h->x[h->order[t->first + t->count - 1]];
+		py[2*k+1] = h->y[h->order[t->first + t->count - 1]];
+		ids[k++] = i;
+	}
+	if (k == 0)
+		return;
+
+	// entering tool i in direction d (1 = reversed) at px[2*i+d], leaving at px[2*i+1-d]
+	if (k <= SCHEDULE_EXACT_TOOLS) {
+		int states = 2*k, mask;
+		double *dp = malloc(sizeof(double) * (1 << k) * states);
+		int *from = malloc(sizeof(int) * (1 << k) * states);
+
+		for (mask=0; mask < (1 << k); mask++)
+			for (i=0; i<states; i++)
+				dp[mask*states + i] = INFINITY;
+		for (i=0; i<states; i++) {
+			dp[(1 << (i/2))*states + i] = travel_cost(start_x, start_y, px[i], py[i]);
+			from[(1 << (i/2))*states + i] = -1;
+		}
+
+		for (mask=1; mask < (1 << k); mask++)
+		for (i=0; i<states; i++) {
+			double c = dp[mask*states + i];
+			if (c == INFINITY)
+				continue;
+			int exit = i ^ 1;
+			for (j=0; j<states; j++) {
+				if (mask & (1 << (j/2)))
+					continue;
+				int next = (mask | (1 << (j/2)))*states + j;
+				double cj = c + travel_cost(px[exit], py[exit], px[j], py[j]);
+				if (cj < dp[next]) {
+					dp[next] = cj;
+					from[next] = i;
+				}
+			}
+		}
+
+		int best = 0;
+		mask = (1 << k) - 1;
+		for (i=1; i<states; i++)
+			if (dp[mask*states + i] < dp[mask*states + best])
+				best = i;
+		for (j=k-1; j>=0; j--) {
+			seq[j] = best / 2;
+			seq_dir[j] = best % 2;
+			int prev = from[mask*states + best];
+			mask &= ~(1 << (best/2));
+			best = prev;
+		}
+
+		free(dp);
+		free(from);
+	} else {
+		char used[MAX_TOOLS] = { };
+		float cur_x = start_x, cur_y = start_y;
+		for (j=0; j<k; j++) {
+			int best = -1;
+			for (i=0; i<2*k; i++)
+				if (!used[i/2] && (best < 0 || travel_cost(cur_x, cur_y, px[i], py[i]) <
+						travel_cost(cur_x, cur_y, px[best], py[best])))
+					best = i;
+			used[best/2] = 1;
+			seq[j] = best / 2;
+			seq_dir[j] = best % 2;
+			cur_x = px[best ^ 1];
+			cur_y = py[best ^ 1];
+		}
+	}
+
+	// rebuild the tool table and the drilling sequence in the new order
+	struct tool_info old_tools[MAX_TOOLS];
+	int *old_order = malloc(sizeof(int)*h->order_count);
+	int map[MAX_TOOLS], pos = 0, n = 0;
+
+	memcpy(old_tools, h->tools, sizeof(old_tools));
+	memcpy(old_order, h->order, sizeof(int)*h->order_count);
+	for (i=0; i<h->tool_count; i++)
+		map[i] = -1;
+	for (j=0; j<k; j++)
+		map[ids[seq[j]]] = n++;
+	for (i=0; i<h->tool_count; i++)
+		if (map[i] < 0)
+			map[i] = n++;
+
+	for (i=0; i<h->tool_count; i++) {
+		struct tool_info *t = &h->tools[map[i]];
+		*t = old_tools[i];
+	}
+	for (i=0; i<h->tool_count; i++) {
+		struct tool_info *t = &h->tools[i];
+		int old_first = t->first, dir = 0;
+		for (j=0; j<k; j++)
+			if (map[ids[seq[j]]] == i)
+				dir = seq_dir[j];
+		t->first = pos;
+		for (j=0; j<t->count; j++)
+			h->order[pos++] = old_order[old_first + (dir ? t->count-1-j : j)];
+	}
+	for (i=0; i<h->count; i++)
+		h->tool[i] = map[h->tool[i]];
+	free(old_order);
+
+	console_plan("Tool order:");
+	for (i=0; i<k; i++)
+		console_plan(" T%d", h->tools[i].number);
+	console_plan("\n");
+}
+
+// board coordinates of the CNC head (inverse of the transformation)
+void get_head_board_pos(float *x, float *y)
+{
+	struct matrixop *op = &active_matrixop;
+	float det = op->a * op->d - op->b * op->c;
+	float xp = nm_to_mm(cnc_x) - op->e, yp = nm_to_mm(cnc_y) - op->f;
+
+	if (det == 0) {
+		*x = current_x;
+		*y = current_y;
+		return;
+	}
+	*x = (xp * op->d - yp * op->c) / det;
+	*y = (yp * op->a - xp * op->b) / det;
+}
+
+// grid index over the board positions of all holes, for drawing and picking them
+struct hole_grid hole_index;
+
+/*
+ * Re-plan the holes of tool k that are not drilled yet, starting at the
+ * given position (e.g. where the head is after a tool change). The done
+ * holes are moved to the front of the tool's range.
+ */
+void reschedule_tool(int k, float start_x, float start_y)
+{
+	struct tool_info *t = &holes.tools[k];
+	float *x = malloc(sizeof(float)*t->count);
+	float *y = malloc(sizeof(float)*t->count);
+	int *undone = malloc(sizeof(int)*t->count);
+	int *order = malloc(sizeof(int)*t->count);
+	int i, n = 0, pos = t->first;
+
+	for (i=t->first; i<t->first+t->count; i++) {
+		int h = holes.order[i];
+		if (hole_is_done(&holes, h)) {
+			holes.order[pos++] = h;
+		} else {
+			x[n] = holes.x[h];
+			y[n] = holes.y[h];
+			undone[n++] = h;
+		}
+	}
+
+	if (order_mode == ORDER_OPTIMIZED) {
+		tsp_optimize(x, y, n, start_x, start_y, order,
+				opt_time_budget / 1000.0 / holes.tool_count, travel_cost);
+	} else {
+		// keep the curve order, starting at the end of it closer to the head
+		int reverse = n > 0 && hypot(x[n-1] - start_x, y[n-1] - start_y) <
+				hypot(x[0] - start_x, y[0] - start_y);
+		for (i=0; i<n; i++)
+			order[i] = reverse ? n-1-i : i;
+	}
+	for (i=0; i<n; i++)
+		holes.order[pos++] = undone[order[i]];
+
+	free(x);
+	free(y);
+	free(undone);
+	free(order);
+}
+
+// optimize the path of each tool, then choose the order of the tools
+void optimize_drill_order(struct hole_table *h, float start_x, float start_y)
+{
+	int n = h->order_count;
+	float *x = malloc(sizeof(float)*n);
+	float *y = malloc(sizeof(float)*n);
+	int *old_order = malloc(sizeof(int)*n);
+	int *order = malloc(sizeof(int)*n);
+	int i, k;
+
+	for (k=0; k<h->tool_count; k++) {
+		struct tool_info *t = &h->tools[k];
+		if (t->count == 0)
+			continue;
+
+		for (i=0; i<t->count; i++) {
+			old_order[i] = h->order[t->first + i];
+			x[i] = h->x[old_order[i]];
+			y[i] = h->y[old_order[i]];
+		}
+
+		tsp_optimize(x, y, t->count, start_x, start_y, order,
+				opt_time_budget / 1000.0 / h->tool_count, travel_cost);
+
+		for (i=0; i<t->count; i++)
+			h->order[t->first + i] = old_order[order[i]];
+	}
+
+	free(x);
+	free(y);
+	free(old_order);
+	free(order);
+
+	schedule_tools(h, start_x, start_y);
+}
+
+/*
+ * Order the drill list as selected with -o, starting at the given
+ * position. The travel of both space filling curve orders is always
+ * computed for the report.
+ */
+void order_drill_list(struct hole_table *h, float start_x, float start_y, struct order_stats *st)
+{
+	int i, k;
+
+	sort_drill_list_by_morton_num(h);
+	st->len_morton = get_drill_list_length(h);
+	sort_drill_list_by_hilbert_num(h);
+	st->len_hilbert = get_drill_list_length(h);
+
+	if (order_mode == ORDER_MORTON)
+		sort_drill_list_by_morton_num(h);
+	if (order_mode == ORDER_OPTIMIZED)
+		optimize_drill_order(h, start_x, start_y);
+	st->len = get_drill_list_length(h);
+
+	st->hops = 0;
+	for (k=0; k<h->tool_count; k++)
+		for (i=h->tools[k].first+1; i<h->tools[k].first+h->tools[k].count; i++) {
+			int a = h->order[i-1], b = h->order[i];
+			if (hypot(h->x[b] - h->x[a], h->y[b] - h->y[a]) < hop_distance)
+				st->hops++;
+		}
+
+	st->tool_changes = 0;
+	for (k=0; k<h->tool_count; k++)
+		if (h->tools[k].count > 0)
+			st->tool_changes++;
+	if (st->tool_changes > 0)
+		st->tool_changes--;
+	st->time = travel_model->cost == travel_cost_time ?
+		st->len + st->tool_changes * TOOL_CHANGE_TIME : -1;
+}
+
+void print_order_stats(struct order_stats *st)
+{
+	console("Drilling path travel (%s model):\n", travel_model->name);
+	console("     %12.2f %s morton order\n", st->len_morton, travel_model->unit);
+	console("     %12.2f %s hilbert order\n", st->len_hilbert, travel_model->unit);
+
+	if (order_mode == ORDER_OPTIMIZED) {
+		double len_best = fmin(st->len_morton, st->len_hilbert);
+		console("     %12.2f %s optimized (%.1f%% less)\n", st->len, travel_model->unit,
+				len_best > 0 ? 100 * (1 - st->len/len_best) : 0);
+	}
+
+	if (st->hops > 0) {
+		float z_saved = st->hops * 2 * nm_to_mm(Z_VALUE_UP - Z_VALUE_MID);
+		console("Short hops (< %.1f mm): %d, saving %.1f mm Z travel (%.1f s)\n",
+				hop_distance, st->hops, z_saved, z_saved / (FEEDRATE_HIGH / 60.0));
+	}
+
+	if (st->time >= 0)
+		console("Estimated travel and tool change time: %.0f s (%d tool changes)\n",
+				st->time, st->tool_changes);
+}
+
+/*
+ * Coordinate format of an Excellon file, from the header. Coordinates
+ * without decimal point have int_digits+frac_digits places and either
+ * the leading (TZ, trailing zeros kept) or the trailing (LZ, leading
+ * zeros kept) zeros suppressed. Without METRIC/INCH/M71/M72 in the header
+ * the digits are taken as a number with 10 places, like old versions of
+ * metadrill did. All values are converted to mm.
+ */
+struct drl_format {
+	int metric;		// 1 = mm, 0 = inch, -1 = unknown
+	int trailing_zeros;	// TZ
+	int int_digits, frac_digits;
+	int file_format;	// digits given by ;FILE_FORMAT=
+};
+
+/*
+ * Decode an Excellon coordinate at p. Returns the position after the
+ * coordinate or NULL if there are no digits.
+ */
+const char *decode_coord(const char *p, const char *end, struct drl_format *fmt, int64_t *v)
+{
+	static const int64_t pow10[] = { 1, 10, 100, 1000, 10000, 100000, 1000000, 10000000,
+			100000000, 1000000000, 10000000000LL };
+	int neg = 0, digits = 0, point = -1;
+	int64_t m = 0;
+
+	if (p < end && (*p == '-' || *p == '+')) {
+		neg = *p == '-';
+		p++;
+	}
+	for (; p < end && ((*p >= '0' && *p <= '9') || (*p == '.' && point < 0)); p++) {
+		if (*p == '.') {
+			point = digits;
+			continue;
+		}
+		if (digits < 18)
+			m = m*10 + (*p - '0');
+		digits++;
+	}
+	if (digits == 0)
+		return NULL;
+	if (digits > 18)
+		digits = 18;
+
+	int places;
+	if (point >= 0)
+		places = digits - point;
+	else if (fmt->metric < 0)
+		places = digits - 10;
+	else if (fmt->trailing_zeros)
+		places = fmt->frac_digits;
+	else
+		places = fmt->frac_digits - (fmt->int_digits + fmt->frac_digits - digits);
+
+	if (places > 10)
+		places = 10;
+
+	// in nm, rounded: 1 mm = 1000000 nm, 1 inch = 25400000 nm
+	int64_t unit = fmt->metric == 0 ? 254 * NM_PER_MM / 10 : NM_PER_MM;
+	if (places < 0) {
+		m *= pow10[-places < 10 ? -places : 10];
+		places = 0;
+	}
+	// m * unit / 10^places, split so that no product overflows int64
+	int64_t q = m / pow10[places], r = m % pow10[places];
+	if (q >= INT64_MAX / unit)
+		q = INT64_MAX / unit - 1;
+	m = q * unit + (r * unit + pow10[places] / 2) / pow10[places];
+	*v = neg ? -m : m;
+	return p;
+}
+
+// decode a plain decimal number (tool diameters etc.)
+const char *decode_decimal(const char *p, const char *end, float *v)
+{
+	double val = 0, scale = 1;
+	int neg = 0, digits = 0;
+
+	if (p < end && *p == '-') {
+		neg = 1;
+		p++;
+	}
+	for (; p < end && *p >= '0' && *p <= '9'; p++, digits++)
+		val = val*10 + (*p - '0');
+	if (p < end && *p == '.')
+		for (p++; p < end && *p >= '0' && *p <= '9'; p++, digits++)
+			val += (*p - '0') * (scale /= 10);
+	if (digits == 0)
+		return NULL;
+
+	*v = neg ? -val : val;
+	return p;
+}
+
+const char *decode_int(const char *p, const char *end, int *v)
+{
+	int digits = 0;
+	for (*v = 0; p < end && *p >= '0' && *p <= '9'; p++, digits++)
+		*v = *v*10 + (*p - '0');
+	return digits ? p : NULL;
+}
+
+int line_starts_with(const char *p, const char *eol, const char *s)
+{
+	int len = strlen(s);
+	return eol - p >= len && !memcmp(p, s, len);
+}
+
+// "METRIC", "INCH" with optional ",LZ"/",TZ" and ",000.000" style digit format
+void parse_drl_units(const char *p, const char *eol, struct drl_format *fmt)
+{
+	fmt->metric = *p == 'M';
+	// default digits of the unit, unless ;FILE_FORMAT= came first (Altium)
+	if (!fmt->file_format) {
+		fmt->int_digits = fmt->metric ? 3 : 2;
+		fmt->frac_digits = fmt->metric ? 3 : 4;
+	}
+
+	while ((p = memchr(p, ',', eol - p)) != NULL) {
+		p++;
+		if (line_starts_with(p, eol, "TZ"))
+			fmt->trailing_zeros = 1;
+		if (line_starts_with(p, eol, "LZ"))
+			fmt->trailing_zeros = 0;
+		if (p < eol && *p == '0') {
+			const char *q = p;
+			for (fmt->int_digits = 0; q < eol && *q == '0'; q++)
+				fmt->int_digits++;
+			if (q < eol && *q == '.')
+				for (fmt->frac_digits = 0, q++; q < eol && *q == '0'; q++)
+					fmt->frac_digits++;
+		}
+	}
+}
+
+/*
+ * Parse an Excellon drill file in memory (no copies, no libc formatting
+ * unless verbose) and add its holes to the hole table.
+ */
+void parse_drl(struct hole_table *h, const char *data, size_t len)
+{
+	const char *p = data, *end = data + len, *eol;
+	struct drl_format fmt = { -1, 1, 3, 3, 0 };
+	int current_tool = -1;
+	int64_t x = 0, y = 0;
+
+	for (; p < end; p = eol + 1) {
+		eol = memchr(p, '\n', end - p);
+		if (!eol)
+			eol = end;
+		if (verbose)
+			console_job("%.*s\n", (int)(eol - p), p);
+
+		if (line_starts_with(p, eol, "METRIC") || line_starts_with(p, eol, "INCH")) {
+			parse_drl_units(p, eol, &fmt);
+			continue;
+		}
+		if (line_starts_with(p, eol, "M71") || line_starts_with(p, eol, "M72")) {
+			const char *units = p[2] == '1' ? "METRIC" : "INCH";
+			parse_drl_units(units, units + strlen(units), &fmt);
+			continue;
+		}
+		if (line_starts_with(p, eol, ";FILE_FORMAT=")) {
+			const char *q = decode_int(p+13, eol, &fmt.int_digits);
+			if (q && q < eol && *q == ':')
+				decode_int(q+1, eol, &fmt.frac_digits);
+			fmt.file_format = 1;
+			continue;
+		}
+
+		// tool definition (T1C0.8, T01F00S00C0.800) or tool selection (T1)
+		if (*p == 'T') {
+			int number;
+			const char *q = decode_int(p+1, eol, &number);
+			if (!q)
+				continue;
+			current_tool = number > 0 ? hole_table_tool(h, number) : -1;
+			while (q < eol && *q != 'C')
+				q++;
+			float v1;
+			if (current_tool >= 0 && q < eol && decode_decimal(q+1, eol, &v1)) {
+				h->tools[current_tool].diameter = fmt.metric == 0 ? v1 * 25.4 : v1;
+			}
+			continue;
+		}
+
+		// coordinates are modal, a line may have only X or only Y
+		if ((*p == 'X' || *p == 'Y') && current_tool >= 0) {
+			const char *q = p;
+			if (*q == 'X' && !(q = decode_coord(q+1, eol, &fmt, &x)))
+				continue;
+			if (q < eol && *q == 'Y' && !decode_coord(q+1, eol, &fmt, &y))
+				continue;
+			int i = hole_table_add(h, x, y, current_tool);
+			if (verbose)
+				console_job("%f %f\n", h->x[i], h->y[i]);
+			if (i == 0) {
+				h->min_x = h->max_x = h->x[i];
+				h->min_y = h->max_y = h->y[i];
+			}
+			if (h->x[i] < h->min_x)
+				h->min_x = h->x[i];
+			if (h->x[i] > h->max_x)
+				h->max_x = h->x[i];
+			if (h->y[i] < h->min_y)
+				h->min_y = h->y[i];
+			if (h->y[i] > h->max_y)
+				h->max_y = h->y[i];
+		}
+	}
+
+	hole_table_group_by_tool(h);
+}
+
+// load a drill file into an empty hole table, returns -1 if it can't be read
+int load_drlfile(struct hole_table *h, const char *filename)
+{
+	int i;
+#ifdef WIN32
+	FILE *f = fopen(filename, "rb");
+	if (f == NULL)
+		return -1;
+	CHECK(fseek(f, 0, SEEK_END), == 0);
+	size_t len = CHECK(ftell(f), >= 0);
+	rewind(f);
+	char *data = CHECK(malloc(len + 1), != NULL);
+	CHECK(fread(data, 1, len, f), == len);
+	fclose(f);
+	parse_drl(h, data, len);
+	free(data);
+#else
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	struct stat st;
+	CHECK(fstat(fd, &st), == 0);
+	if (st.st_size > 0) {
+		char *data = CHECK(mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0), != MAP_FAILED);
+		madvise(data, st.st_size, MADV_SEQUENTIAL);
+		parse_drl(h, data, st.st_size);
+		munmap(data, st.st_size);
+	}
+	close(fd);
+#endif
+
+	for (i=0; i<h->tool_count; i++)
+		tool_apply_profile(&h->tools[i]);
+	return 0;
+}
+
+void read_drlfile(const char *filename)
+{
+	struct order_stats st;
+	int i;
+
+	if (load_drlfile(&holes, filename) < 0) {
+		console("Can't open %s: %s\n", filename, strerror(errno));
+		exit(1);
+	}
+
+	min_x = holes.min_x;
+	max_x = holes.max_x;
+	min_y = holes.min_y;
+	max_y = holes.max_y;
+
+	console("Drillfile statistics:\n");
+	console("     %5d drill positions\n", holes.count);
+	for (i=0; i<holes.tool_count; i++)
+		console("     T%-3d %6.3f mm: %5d holes, plunge F%.0f, retract F%.0f\n",
+				holes.tools[i].number, holes.tools[i].diameter, holes.tools[i].count,
+				holes.tools[i].plunge_feed, holes.tools[i].retract_feed);
+	console("     x-range: %f - %f\n", min_x, max_x);
+	console("     y-range: %f - %f\n", min_y, max_y);
+	current_x = min_x;
+	current_y = min_y;
+	current_z = Z_STATE_UP;
+	target_x = max_x;
+	target_y = max_y;
+	target_hole = -1;
+	drilling = 0;
+
+	hole_grid_free(&hole_index);
+	hole_grid_build(&hole_index, holes.x, holes.y, holes.count);
+	view_reset();
+
+	order_drill_list(&holes, current_x, current_y, &st);
+	print_order_stats(&st);
+}
+
+/*
+ * Benchmark (-B): parse a synthetic drill file with n coordinate lines.
+ * Checks the header order of Altium first: ;FILE_FORMAT= before the unit
+ * line, TZ coordinates (1.5 and 1 inch).
+ */
+void benchmark_parse(int n)
+{
+	static const char altium[] = "M48\n;FILE_FORMAT=2:5\nINCH,TZ\nT1F00S00C0.03150\n%\n"
+			"T01\nX150000Y100000\nM30\n";
+	char *data = malloc((size_t)n * 24 + 64), *p = data;
+	struct hole_table h = { };
+	double t;
+	int i;
+
+	parse_drl(&h, altium, strlen(altium));
+	CHECK(h.count, == 1);
+	CHECK(h.nx[0], == 38100000);
+	CHECK(h.ny[0], == 25400000);
+	free(h.arena);
+	memset(&h, 0, sizeof(h));
+
+	srand(1);
+	p += sprintf(p, "M48\nMETRIC,TZ\nT1C0.800\n%%\nG90\nG05\nT1\n");
+	for (i=0; i<n; i++)
+		p += sprintf(p, "X%dY%d\n", rand() % 300000, -(rand() % 200000));
+	p += sprintf(p, "T0\nM30\n");
+
+	t = get_time();
+	parse_drl(&h, data, p - data);
+	printf("Parsing %d lines (%.1f MB): %8.2f ms, %d holes\n", n + 9,
+			(p - data) / 1e6, (get_time() - t) * 1000, h.count);
+
+	free(h.arena);
+	free(data);
+}
+
+void set_default_matrixop(struct matrixop *op)
+{
+	op->a = 1;
+	op->b = 0;
+	op->c = 0;
+	op->d = 1;
+	op->e = 0;
+	op->f = 0;
+}
+
+void print_matrixop(struct matrixop *op)
+{
+	console("                    / %+e %+e \\\n", op->a, op->b);
+	console("(xp yp) = (xf yf) * |                             | + (%+e %+e)\n", op->e, op->f);
+	console("                    \\ %+e %+e /\n", op->c, op->d);
+}
+
+int correction_terms(int degree)
+{
+	return degree == 3 ? 7 : degree == 2 ? 3 : 0;
+}
+
+typedef double v4df __attribute__ ((vector_size (32)));
+
+/*
+ * Correction (dx, dy) of four board positions (x, y) in mm, with GCC
+ * vector extensions.
+ */
+static inline void correction_eval(struct correction *cor, const v4df *x, const v4df *y,
+		v4df *dx, v4df *dy)
+{
+	const double *kx = cor->kx, *ky = cor->ky;
+	double inv_scale = 1 / cor->scale;
+
+	v4df u = (*x - cor->cx) * inv_scale;
+	v4df v = (*y - cor->cy) * inv_scale;
+
+	v4df uu = u*u, uv = u*v, vv = v*v;
+	*dx = kx[0]*uu + kx[1]*uv + kx[2]*vv;
+	*dy = ky[0]*uu + ky[1]*uv + ky[2]*vv;
+	if (cor->degree == 3) {
+		*dx += kx[3]*uu*u + kx[4]*uu*v + kx[5]*u*vv + kx[6]*vv*v;
+		*dy += ky[3]*uu*u + ky[4]*uu*v + ky[5]*u*vv + ky[6]*vv*v;
+	}
+}
+
+/*
+ * Machine positions (xp, yp) of n board positions (xf, yf), all in nm:
+ * matrix and correction in double precision, four at a time, rounded
+ * to the nm.
+ */
+void transform_batch(struct matrixop *op, struct correction *cor, const int64_t *xf,
+		const int64_t *yf, int64_t *xp, int64_t *yp, int n)
+{
+	int i, j;
+
+	for (i=0; i<n; i+=4) {
+		int len = n-i < 4 ? n-i : 4;
+		v4df x = { }, y = { }, dx, dy;
+		for (j=0; j<len; j++) {
+			x[j] = nm_to_mm(xf[i+j]);
+			y[j] = nm_to_mm(yf[i+j]);
+		}
+		/*
+		 *                      / a b \
+		 *  (xp yp) = (xf yf) * |     | + (e f)
+		 *                      \ c d /
+		 */
+		v4df px = op->a * x + op->c * y + op->e;
+		v4df py = op->b * x + op->d * y + op->f;
+		if (cor->degree) {
+			correction_eval(cor, &x, &y, &dx, &dy);
+			px += dx;
+			py += dy;
+		}
+		for (j=0; j<len; j++) {
+			xp[i+j] = mm_to_nm(px[j]);
+			yp[i+j] = mm_to_nm(py[j]);
+		}
+	}
+}
+
+// machine coordinates of all holes, to be redone whenever the transformation changes
+void hole_table_transform(struct hole_table *h, struct matrixop *op, struct correction *cor)
+{
+	transform_batch(op, cor, h->nx, h->ny, h->mx, h->my, h->count);
+}
+
+/*
+ * Soft limits of the machine (-L), checked for all holes of the drilling
+ * sequence before drilling or writing a G-code file.
+ */
+int soft_limits;
+double soft_limit_x[2], soft_limit_y[2];
+
+int hole_outside_limits(struct hole_table *h, int i)
+{
+	double x = nm_to_mm(h->mx[i]), y = nm_to_mm(h->my[i]);
+	return soft_limits && (x < soft_limit_x[0] || x > soft_limit_x[1] ||
+			y < soft_limit_y[0] || y > soft_limit_y[1]);
+}
+
+// number of holes still to drill that are outside of the soft limits, the first one in *first
+int hole_table_check_limits(struct hole_table *h, int *first)
+{
+	int i, count = 0;
+
+	*first = -1;
+	if (!soft_limits)
+		return 0;
+	for (i=0; i<h->order_count; i++)
+		if (!hole_is_done(h, h->order[i]) && hole_outside_limits(h, h->order[i]) &&
+				count++ == 0)
+			*first = h->order[i];
+	return count;
+}
+
+// update the machine coordinates of the holes after loading or calibration
+int update_machine_coords()
+{
+	int first, outside;
+
+	hole_table_transform(&holes, &active_matrixop, &active_correction);
+	outside = hole_table_check_limits(&holes, &first);
+	if (soft_limits) {
+		hole_layer_valid = 0;
+		screen_needs_update = 1;
+	}
+	if (outside > 0) {
+		console("%d holes are outside of the soft limits, e.g. X=%f, Y=%f (machine X=%f, Y=%f)!\n",
+				outside, holes.x[first], holes.y[first],
+				nm_to_mm(holes.mx[first]), nm_to_mm(holes.my[first]));
+		screen_needs_update = 1;
+	}
+	return outside;
+}
+
+// solve the symmetric m x m system a x = b (Gaussian elimination), returns -1 if singular
+int solve_linear(double *a, double *b, double *x, int m)
+{
+	int i, j, k;
+
+	for (i=0; i<m; i++) {
+		int p = i;
+		for (j=i+1; j<m; j++)
+			if (fabs(a[j*m+i]) > fabs(a[p*m+i]))
+				p = j;
+		if (fabs(a[p*m+i]) < 1e-12)
+			return -1;
+		for (k=0; k<m; k++) {
+			double tmp = a[i*m+k];
+			a[i*m+k] = a[p*m+k];
+			a[p*m+k] = tmp;
+		}
+		double tmp = b[i];
+		b[i] = b[p];
+		b[p] = tmp;
+
+		for (j=i+1; j<m; j++) {
+			double f = a[j*m+i] / a[i*m+i];
+			for (k=i; k<m; k++)
+				a[j*m+k] -= f * a[i*m+k];
+			b[j] -= f * b[i];
+		}
+	}
+
+	for (i=m-1; i>=0; i--) {
+		x[i] = b[i];
+		for (k=i+1; k<m; k++)
+			x[i] -= a[i*m+k] * x[k];
+		x[i] /= a[i*m+i];
+	}
+	return 0;
+}
+
+/*
+ * Least squares fit of the transformation matrix together with a
+ * correction of the given degree. Needs more samples than coefficients
+ * per axis (3 + terms). Returns -1 if there are not enough samples or
+ * they don't determine the coefficients.
+ */
+int adjust_fit_correction(struct adjust_sample **samples, int n, int degree,
+		struct matrixop *op, struct correction *cor)
+{
+	int terms = correction_terms(degree), m = 3 + terms, i, j, k;
+	double ata[m*m], atx[m], aty[m], sol_x[m], sol_y[m];
+
+	if (n <= m)
+		return -1;
+
+	cor->degree = degree;
+	cor->cx = cor->cy = cor->scale = 0;
+	for (i=0; i<n; i++) {
+		cor->cx += samples[i]->xf / n;
+		cor->cy += samples[i]->yf / n;
+	}
+	for (i=0; i<n; i++)
+		cor->scale = fmax(cor->scale, fmax(fabs(samples[i]->xf - cor->cx),
+				fabs(samples[i]->yf - cor->cy)));
+	if (cor->scale == 0)
+		return -1;
+
+	memset(ata, 0, sizeof(ata));
+	memset(atx, 0, sizeof(atx));
+	memset(aty, 0, sizeof(aty));
+	for (i=0; i<n; i++) {
+		double u = (samples[i]->xf - cor->cx) / cor->scale;
+		double v = (samples[i]->yf - cor->cy) / cor->scale;
+		double row[] = { 1, u, v, u*u, u*v, v*v, u*u*u, u*u*v, u*v*v, v*v*v };
+		for (j=0; j<m; j++) {
+			for (k=0; k<m; k++)
+				ata[j*m+k] += row[j] * row[k];
+			atx[j] += row[j] * samples[i]->xp;
+			aty[j] += row[j] * samples[i]->yp;
+		}
+	}
+
+	double ata_y[m*m];
+	memcpy(ata_y, ata, sizeof(ata));
+	if (solve_linear(ata, atx, sol_x, m) < 0 || solve_linear(ata_y, aty, sol_y, m) < 0)
+		return -1;
+
+	// the linear part goes into the matrix
+	op->a = sol_x[1] / cor->scale;
+	op->c = sol_x[2] / cor->scale;
+	op->e = sol_x[0] - op->a * cor->cx - op->c * cor->cy;
+	op->b = sol_y[1] / cor->scale;
+	op->d = sol_y[2] / cor->scale;
+	op->f = sol_y[0] - op->b * cor->cx - op->d * cor->cy;
+	for (j=0; j<CORRECTION_MAX_TERMS; j++) {
+		cor->kx[j] = j < terms ? sol_x[3+j] : 0;
+		cor->ky[j] = j < terms ? sol_y[3+j] : 0;
+	}
+	return 0;
+}
+
+// print how much the correction moves the holes of the board
+void correction_report()
+{
+	if (active_correction.degree == 0 || holes.count == 0)
+		return;
+
+	// machine positions with and without the correction
+	struct correction none = { };
+	int64_t *mx = CHECK(malloc(4 * holes.count * sizeof(int64_t)), != NULL);
+	int64_t *my = mx + holes.count, *lx = my + holes.count, *ly = lx + holes.count;
+	double sum_sq = 0, max = 0;
+	int i;
+
+	transform_batch(&active_matrixop, &active_correction, holes.nx, holes.ny, mx, my, holes.count);
+	transform_batch(&active_matrixop, &none, holes.nx, holes.ny, lx, ly, holes.count);
+	for (i=0; i<holes.count; i++) {
+		double d = hypot(nm_to_mm(mx[i] - lx[i]), nm_to_mm(my[i] - ly[i]));
+		sum_sq += d*d;
+		max = fmax(max, d);
+	}
+	console("Correction (degree %d): max. %.4f, RMS %.4f over %d holes\n",
+			active_correction.degree, max, sqrt(sum_sq / holes.count), holes.count);
+
+	free(mx);
+}
+
+void load_correction(const char *filename)
+{
+	struct correction cor = { };
+	FILE *f;
+	int t;
+
+	if ((f = fopen(filename, "r")) == NULL)
+		return;
+	if (fscanf(f, "%d %lf %lf %lf", &cor.degree, &cor.cx, &cor.cy, &cor.scale) == 4 &&
+			correction_terms(cor.degree) > 0) {
+		for (t=0; t<correction_terms(cor.degree); t++)
+			CHECK(fscanf(f, "%lf %lf", &cor.kx[t], &cor.ky[t]), == 2);
+		active_correction = cor;
+		console("Loaded correction of degree %d from %s.\n", cor.degree, filename);
+	}
+	fclose(f);
+}
+
+void write_correction(const char *filename)
+{
+	FILE *f;
+	int t;
+
+	if (active_correction.degree == 0) {
+		// don't keep a correction for an older matrix
+		if (unlink(filename) == 0)
+			console("Removed %s.\n", filename);
+		return;
+	}
+
+	console("Writing new version of %s.\n", filename);
+	f = CHECK(fopen(filename, "w"), != NULL);
+	fprintf(f, "%d\n%+e\n%+e\n%+e\n", active_correction.degree,
+			active_correction.cx, active_correction.cy, active_correction.scale);
+	for (t=0; t<correction_terms(active_correction.degree); t++)
+		fprintf(f, "%+e %+e\n", active_correction.kx[t], active_correction.ky[t]);
+	fclose(f);
+}
+
+/*
+ * Least squares fit of the transformation to the samples (at least 3):
+ *
+ *	xp = a*xf + c*yf + e
+ *	yp = b*xf + d*yf + f
+ *
+ * Both rows share the same normal equations. The file coordinates are
+ * taken relative to their mean, which separates e and f and leaves a
+ * 2x2 system in double precision. Returns the condition number of the
+ * (centered) sample positions, i.e. the ratio of their spread along the
+ * two principal axes, or -1 if they are on a line.
+ */
+double adjust_fit(struct adjust_sample **samples, int n, struct matrixop *op)
+{
+	double mx = 0, my = 0, mxp = 0, myp = 0;
+	double sxx = 0, sxy = 0, syy = 0;
+	double sx_xp = 0, sy_xp = 0, sx_yp = 0, sy_yp = 0;
+	int i;
+
+	for (i=0; i<n; i++) {
+		struct adjust_sample *s = samples[i];
+		mx += s->xf;
+		my += s->yf;
+		mxp += s->xp;
+		myp += s->yp;
+	}
+	mx /= n;
+	my /= n;
+	mxp /= n;
+	myp /= n;
+
+	for (i=0; i<n; i++) {
+		struct adjust_sample *s = samples[i];
+		double x = s->xf - mx, y = s->yf - my;
+		double xp = s->xp - mxp, yp = s->yp - myp;
+		sxx += x*x;
+		sxy += x*y;
+		syy += y*y;
+		sx_xp += x*xp;
+		sy_xp += y*xp;
+		sx_yp += x*yp;
+		sy_yp += y*yp;
+	}
+
+	// eigenvalues of the symmetric matrix [sxx sxy; sxy syy]
+	double det = sxx*syy - sxy*sxy;
+	double half_tr = (sxx + syy) / 2;
+	double root = sqrt(fmax(half_tr*half_tr - det, 0));
+	double l_max = half_tr + root, l_min = half_tr - root;
+	if (l_min <= l_max * 1e-12)
+		return -1;
+
+	op->a = (syy*sx_xp - sxy*sy_xp) / det;
+	op->c = (sxx*sy_xp - sxy*sx_xp) / det;
+	op->b = (syy*sx_yp - sxy*sy_yp) / det;
+	op->d = (sxx*sy_yp - sxy*sx_yp) / det;
+	op->e = mxp - op->a*mx - op->c*my;
+	op->f = myp - op->b*mx - op->d*my;
+
+	return sqrt(l_max / l_min);
+}
+
+double adjust_residual(struct adjust_sample *s, struct matrixop *op)
+{
+	struct correction none = { };
+	int64_t xf = mm_to_nm(s->xf), yf = mm_to_nm(s->yf), xp, yp;
+	transform_batch(op, &none, &xf, &yf, &xp, &yp, 1);
+	return hypot(nm_to_mm(xp) - s->xp, nm_to_mm(yp) - s->yp);
+}
+
+/*
+ * RANSAC over the calibration points: fit the transformation to triples
+ * of points and keep the triple most points agree with (residual below
+ * ADJUST_TOLERANCE, ties broken by the sum of the residuals). The points
+ * that don't agree are marked as outliers, but only if more than three
+ * points agree (with four points and one wrong it can't be told which
+ * one it is). Returns the number of inliers.
+ */
+int adjust_ransac()
+{
+	struct adjust_sample *samples[adj_count], *a;
+	int n = 0, best = 0, i, j, k, iter;
+	double best_sum = 0;
+	struct matrixop best_op;
+
+	for (a=adj_list; a; a=a->next) {
+		a->outlier = 0;
+		samples[n++] = a;
+	}
+	if (n < 4)
+		return n;
+
+	// all triples i < j < k, or random ones (own generator, same result every time)
+	uint32_t seed = 1;
+	int next_random() {
+		seed = seed * 1103515245 + 12345;
+		return (seed >> 8) % n;
+	}
+	i = 0, j = 1, k = 2;
+	for (iter=0; iter < ADJUST_RANSAC_ITERATIONS; iter++) {
+		if (n > ADJUST_RANSAC_ALL) {
+			i = next_random();
+			j = next_random();
+			k = next_random();
+			if (i == j || i == k || j == k)
+				continue;
+		} else if (iter > 0 && ++k == n) {
+			if (++j == n-1) {
+				if (++i == n-2)
+					break;
+				j = i+1;
+			}
+			k = j+1;
+		}
+
+		struct adjust_sample *triple[3] = { samples[i], samples[j], samples[k] };
+		struct matrixop op;
+		if (adjust_fit(triple, 3, &op) < 0)
+			continue;
+
+		int inliers = 0, l;
+		double sum = 0;
+		for (l=0; l<n; l++) {
+			double r = adjust_residual(samples[l], &op);
+			if (r < ADJUST_TOLERANCE) {
+				inliers++;
+				sum += r;
+			}
+		}
+		if (inliers > best || (inliers == best && sum < best_sum)) {
+			best = inliers;
+			best_sum = sum;
+			best_op = op;
+		}
+	}
+
+	if (best <= 3)
+		return best;
+	for (i=0; i<n; i++)
+		samples[i]->outlier = adjust_residual(samples[i], &best_op) >= ADJUST_TOLERANCE;
+	return best;
+}
+
+// check the calibration points after a new one has been added
+void adjust_check()
+{
+	struct adjust_sample *a;
+	int inliers = adjust_ransac();
+
+	if (inliers == adj_count)
+		return;
+	if (inliers <= 3) {
+		console("The adjust points don't agree (tolerance %.2f mm), add more points.\n",
+				ADJUST_TOLERANCE);
+		return;
+	}
+	for (a=adj_list; a; a=a->next)
+		if (a->outlier)
+			console("Adjust point [ %f %f ] => [ %f %f ] doesn't agree with the others!\n",
+					a->xf, a->yf, a->xp, a->yp);
+	screen_needs_update = 1;
+}
+
+void adjust_run()
+{
+	struct adjust_sample *samples[adj_count], *a1, *a2;
+	struct matrixop resultop;
+	int n = 0;
+
+	if (adj_count < 3) {
+		console("Need at least 3 points to run adjust!\n");
+		return;
+	}
+
+	// fit to the points that agree with each other
+	adjust_check();
+	for (a1=adj_list; a1; a1=a1->next)
+		if (!a1->outlier)
+			samples[n++] = a1;
+
+	double cond = adjust_fit(samples, n, &resultop);
+	if (cond < 0) {
+		console("The adjust points are on a line, add a point off that line!\n");
+		return;
+	}
+
+	struct correction cor = { };
+	if (correction_degree > 0 &&
+			adjust_fit_correction(samples, n, correction_degree, &resultop, &cor) < 0) {
+		console("Need at least %d points (not on a line) for a correction of degree %d.\n",
+				4 + correction_terms(correction_degree), correction_degree);
+		adjust_fit(samples, n, &resultop);
+		cor.degree = 0;
+	}
+
+	double sum_sq = 0;
+	console("Adjust:\n");
+	for (a1=adj_list; a1; a1=a1->next) {
+		int64_t xf = mm_to_nm(a1->xf), yf = mm_to_nm(a1->yf), xp, yp;
+		transform_batch(&resultop, &cor, &xf, &yf, &xp, &yp, 1);
+		double dx = nm_to_mm(xp) - a1->xp, dy = nm_to_mm(yp) - a1->yp;
+		if (!a1->outlier)
+			sum_sq += dx*dx + dy*dy;
+		console("[ %f %f ] => [ %f %f ], residual %+.4f %+.4f (%.4f)%s\n",
+				a1->xf, a1->yf, a1->xp, a1->yp, dx, dy, hypot(dx, dy),
+				a1->outlier ? ", outlier (not used)" : "");
+	}
+	console("RMS error: %.4f, condition number: %.2f (%d of %d points)\n",
+			sqrt(sum_sq / n), cond, n, adj_count);
+
+	active_matrixop = resultop;
+	active_correction = cor;
+
+	console("New matrices:\n");
+	print_matrixop(&active_matrixop);
+	correction_report();
+	update_machine_coords();
+
+	for (a1=adj_list; a1; a1=a2) {
+		a2 = a1->next;
+		free(a1);
+	}
+
+	adj_list = NULL;
+	adj_count = 0;
+}
+
+/*
+ * The view: board position (view_x, view_y) is shown at the centre of
+ * the board area (320, 230), with view_scale pixels per mm and X
+ * mirrored (the board is seen from the bottom). view_reset() fits the
+ * whole board into the 620x440 board area; the mouse wheel and +/- zoom,
+ * dragging with the right button pans.
+ */
+float view_x, view_y, view_scale = 1;
+
+int get_screen_x(float x)
+{
+	float sx = 320 - (x - view_x) * view_scale;
+	return sx < -32768 ? -32768 : sx > 32767 ? 32767 : sx;
+}
+
+int get_screen_y(float y)
 {
-	const struct pos *const *a = a_vp;
-	const struct pos *const *b = b_vp;
-	int a_mn = get_morton_num(get_screen_x((*a)->x), get_screen_y((*a)->y));
-	int b_mn = get_morton_num(get_screen_x((*b)->x), get_screen_y((*b)->y));
-	if (a_mn < b_mn)
-		return -1;
-	if (a_mn > b_mn)
-		return +1;
-	return 0;
+	float sy = 230 - (y - view_y) * view_scale;
+	return sy < -32768 ? -32768 : sy > 32767 ? 32767 : sy;
 }
 
-void sort_drill_list_by_morton_num()
+// board position of a screen position (inverse of get_screen_x/y)
+float get_board_x(int x)
 {
-	struct pos **dl = malloc(sizeof(struct pos*)*drill_count);
-	struct pos *p;
-	int i;
+	return view_x + (320 - x) / view_scale;
+}
 
-	for (i=0, p=drill_list; p; i++, p=p->next)
-		dl[i] = p;
+float get_board_y(int y)
+{
+	return view_y + (230 - y) / view_scale;
+}
 
-	qsort(dl, drill_count, sizeof(struct pos*), &compare_pos_by_morton_num);
+void view_changed()
+{
+	hole_layer_valid = 0;
+	screen_needs_update = 1;
+}
 
-	drill_list = NULL;
-	for (i=0; i < drill_count; i++) {
-		dl[i]->next = drill_list;
-		drill_list = dl[i];
-	}
+// scale that fits the whole board into the board area
+float view_fit_scale()
+{
+	return fmin(620 / fmax(max_x - min_x, 1e-3), 440 / fmax(max_y - min_y, 1e-3));
+}
 
-	free(dl);
+void view_reset()
+{
+	view_x = (min_x + max_x) / 2;
+	view_y = (min_y + max_y) / 2;
+	view_scale = view_fit_scale();
+	view_changed();
 }
 
-void read_drlfile(FILE *f)
+// zoom by factor, keeping the board position under the screen position x/y
+void view_zoom(float factor, int x, int y)
 {
-	char buf[512];
-	int firstdrill = 1;
-	struct pos **current_list = NULL;
-	int *current_count = NULL;
+	float bx = get_board_x(x), by = get_board_y(y);
 
-	fgets(buf, 512, f);
-	while (buf != NULL || buf != EOF) {
-		printf("%s\n", buf);
-		char s1[512], s2[512];
-		float v1, v2;
-		if (sscanf(buf, "T%*dC%f", &v1) >= 1) {
-/*		FIXME use all the T value as drill
-			current_list = NULL;
-			current_count = NULL;
-			if (v1 >= 0.004 && v1 <= 0.006) {
-				current_list = &mark_list;
-				current_count = &mark_count;
-			}
-			if (v1 >= 0.009 && v1 <= 2) {
-				current_list = &mount_list;
-				current_count = &mount_count;
-			}
-			if (v1 >= 2.001 && v1 <= 10) {*/
-				current_list = &drill_list;
-				current_count = &drill_count;
-			//}
-		} //end if  */
-		if (sscanf(buf, "X%[-0-9]Y%[-0-9]", s1, s2) == 2) {
-			sscanf(s1, "%f", &v1);
-			sscanf(s2, "%f", &v2);
-			printf("%f %f\n", v1, v2);
-			v1 *= pow(10, 10-strlen(s1)) * (s1[0] == '-' ? 10 : 1);
-			v2 *= pow(10, 10-strlen(s2)) * (s2[0] == '-' ? 10 : 1);
-			if (firstdrill) {
-				min_x = max_x = v1;
-				min_y = max_y = v2;
-				firstdrill = 0;
-			}
-			if (v1 < min_x)
-				min_x = v1;
-			if (v1 > max_x)
-				max_x = v1;
-			if (v2 < min_y)
-				min_y = v2;
-			if (v2 > max_y)
-				max_y = v2;
-			struct pos *p = malloc(sizeof(struct pos));
-			p->x = v1;
-			p->y = v2;
-			p->done = 0;
-			p->next = *current_list;
-			*current_list = p;
-			(*current_count)++;
-		} //end if */
-		int err = fgets(buf, 512, f);
-		if (!err)
-			break; 
-	} //end while
-	sort_drill_list_by_morton_num();
-	console("Drillfile statistics:\n");
-	console("     %5d mark positions\n", mark_count);
-	console("     %5d mount positions\n", mount_count);
-	console("     %5d drill positions\n", drill_count);
-	console("     x-range: %f - %f\n", min_x, max_x);
-	console("     y-range: %f - %f\n", min_y, max_y);
-	current_x = min_x;
-	current_y = min_y;
-	current_z = Z_STATE_UP;
-	target_x = max_x;
-	target_y = max_y;
-	drilling = 0;
+	view_scale = fmax(view_fit_scale() / 2, fmin(view_scale * factor, VIEW_MAX_SCALE));
+	view_x = bx - (320 - x) / view_scale;
+	view_y = by - (230 - y) / view_scale;
+	view_changed();
 }
 
-void set_default_matrixop(struct matrixop *op)
+void view_pan(int dx, int dy)
 {
-	op->a = 1;
-	op->b = 0;
-	op->c = 0;
-	op->d = 1;
-	op->e = 0;
-	op->f = 0;
+	view_x += dx / view_scale;
+	view_y += dy / view_scale;
+	view_changed();
 }
 
-void print_matrixop(struct matrixop *op)
+void setpixel(int x, int y, int r, int g, int b)
 {
-	console("                    / %+e %+e \\\n", op->a, op->b);
-	console("(xp yp) = (xf yf) * |                             | + (%+e %+e)\n", op->e, op->f);
-	console("                    \\ %+e %+e /\n", op->c, op->d);
+	Uint32 *pixel = screen->pixels;
+	if (x >= 0 && y >= 0 && x < 640 && y < 480)
+		pixel[x + y*640] = r << 16 | g << 8 | b;
 }
 
-void transform(struct transform_job *job)
-{
-	/*
-	 *                      / a b \
-	 *  (xp yp) = (xf yf) * |     | + (e f)
-	 *                      \ c d /
-	 */
-	job->xp = job->op.a * job->xf + job->op.c * job->yf + job->op.e;
-	job->yp = job->op.b * job->xf + job->op.d * job->yf + job->op.f;
-}
-
-void adjust(struct adjust_job *job)
-{
-	/*** Maxima commands used: ***
-		eqx1: xp1 = a*xf1 + c*yf1 + e;
-		eqx2: xp2 = a*xf2 + c*yf2 + e;
-		eqx3: xp3 = a*xf3 + c*yf3 + e;
-		eqy1: yp1 = b*xf1 + d*yf1 + f;
-		eqy2: yp2 = b*xf2 + d*yf2 + f;
-		eqy3: yp3 = b*xf3 + d*yf3 + f;
-		string(algsys([eqx1, eqx2, eqx3, eqy1, eqy2, eqy3],
-				[a, b, c, d, e, f]));
-	*****************************/
-	float xp1 = job->xp[0], xp2 = job->xp[1], xp3 = job->xp[2];
-	float yp1 = job->yp[0], yp2 = job->yp[1], yp3 = job->yp[2];
-	float xf1 = job->xf[0], xf2 = job->xf[1], xf3 = job->xf[2];
-	float yf1 = job->yf[0], yf2 = job->yf[1], yf3 = job->yf[2];
-	job->op.a = ((xp2-xp1)*yf3+(xp1-xp3)*yf2+(xp3-xp2)*yf1)/((xf2-xf1)*yf3+(xf1-xf3)*yf2+(xf3-xf2)*yf1);
-	job->op.b = -((yf2-yf1)*yp3+(yf1-yf3)*yp2+(yf3-yf2)*yp1)/((xf2-xf1)*yf3+(xf1-xf3)*yf2+(xf3-xf2)*yf1);
-	job->op.c = ((xf2-xf1)*xp3+(xf1-xf3)*xp2+(xf3-xf2)*xp1)/((xf2-xf1)*yf3+(xf1-xf3)*yf2+(xf3-xf2)*yf1);
-	job->op.d = ((xf2-xf1)*yp3+(xf1-xf3)*yp2+(xf3-xf2)*yp1)/((xf2-xf1)*yf3+(xf1-xf3)*yf2+(xf3-xf2)*yf1);
-	job->op.e = -((xf1*xp2-xf2*xp1)*yf3+(xf3*xp1-xf1*xp3)*yf2+(xf2*xp3-xf3*xp2)*yf1)/((xf2-xf1)*yf3+(xf1-xf3)*yf2+(xf3-xf2)*yf1);
-	job->op.f = ((xf1*yf2-xf2*yf1)*yp3+(xf3*yf1-xf1*yf3)*yp2+(xf2*yf3-xf3*yf2)*yp1)/((xf2-xf1)*yf3+(xf1-xf3)*yf2+(xf3-xf2)*yf1);
-}
+/*
+ * Retained mode drawing: the background and all holes are rasterised into
+ * hole_layer only when the layout, the background or the soft limits
+ * change; a hole that gets drilled is replotted alone. The overlays
+ * (console, cursors, markers, move lines, status line, prompt) are drawn
+ * on the screen on top of it and their rectangles are remembered, so the
+ * next frame only restores these from the layer and flushes the
+ * rectangles that changed.
+ */
+#define MAX_DIRTY_RECTS 128
 
-void adjust_run()
-{
-	struct adjust_sample *a1, *a2, *a3;
-	struct matrixop resultop = { };
-	int resultop_div = 0;
+Uint32 *hole_layer;
+int hole_layer_drilling;
+SDL_Rect dirty_rects[MAX_DIRTY_RECTS];
+int dirty_count, dirty_full;
 
-	if (adj_count < 3) {
-		console("Need at least 3 points to run adjust!\n");
-		return;
-	}
+/*
+ * Level of detail: when the holes are VIEW_CIRCLE_SPACING pixels apart
+ * or more (cells of the hole index, about two holes each), holes with a
+ * radius of at least VIEW_CIRCLE_RADIUS pixels are drawn as circles of
+ * their real size. All other holes are counted per pixel. A pixel with
+ * a single hole gets the colour of the hole, one with more holes a heat
+ * colour for the number of holes still to drill (yellow for 2 up to red
+ * for HEATMAP_MAX and more).
+ */
+#define HEATMAP_MAX 32
 
-	console("Adjust:\n");
-	for (a1=adj_list; a1; a1=a1->next)
-		console("[ %f %f ] => [ %f %f ]\n", a1->xf, a1->yf, a1->xp, a1->yp);
+uint16_t *layer_count, *layer_undone;
+int *layer_hole;	// a hole of the pixel
+int layer_circles;
 
-	for (a1=adj_list; a1; a1=a1->next)
-	for (a2=adj_list; a2; a2=a2->next)
-	for (a3=adj_list; a3; a3=a3->next)
-	{
-		if (a1 == a2 || a1 == a3 || a2 == a3)
-			continue;
+// remember a rectangle of the screen that differs from the hole layer
+void dirty_add(int x, int y, int w, int h)
+{
+	if (x < 0) {
+		w += x;
+		x = 0;
+	}
+	if (y < 0) {
+		h += y;
+		y = 0;
+	}
+	if (x + w > 640)
+		w = 640 - x;
+	if (y + h > 480)
+		h = 480 - y;
+	if (w <= 0 || h <= 0)
+		return;
+	if (dirty_count == MAX_DIRTY_RECTS) {
+		dirty_full = 1;
+		return;
+	}
+	SDL_Rect r = { x, y, w, h };
+	dirty_rects[dirty_count++] = r;
+}
 
-		struct adjust_job job;
+Uint32 hole_color(int i)
+{
+	if (hole_is_done(&holes, i))
+		return 0x888888;
+	if (hole_outside_limits(&holes, i))
+		return 0xff00ff;
+	return 0xffffff;
+}
 
-		job.xp[0] = a1->xp;
-		job.yp[0] = a1->yp;
-		job.xf[0] = a1->xf;
-		job.yf[0] = a1->yf;
+Uint32 layer_pixel_color(int p)
+{
+	if (layer_count[p] == 1)
+		return hole_color(layer_hole[p]);
+	if (layer_undone[p] == 0)
+		return 0x888888;
 
-		job.xp[1] = a2->xp;
-		job.yp[1] = a2->yp;
-		job.xf[1] = a2->xf;
-		job.yf[1] = a2->yf;
+	// yellow to red, logarithmic in the number of holes
+	int n = layer_undone[p] < HEATMAP_MAX ? layer_undone[p] : HEATMAP_MAX;
+	int g = 0xff - 0xff * log2(n) / log2(HEATMAP_MAX);
+	return 0xff0000 | g << 8;
+}
 
-		job.xp[2] = a3->xp;
-		job.yp[2] = a3->yp;
-		job.xf[2] = a3->xf;
-		job.yf[2] = a3->yf;
+// radius of hole i in pixels if it is drawn as circle, 0 otherwise
+float hole_radius(int i)
+{
+	float r = holes.tools[holes.tool[i]].diameter / 2 * view_scale;
+	return layer_circles && r >= VIEW_CIRCLE_RADIUS ? r : 0;
+}
 
-		adjust(&job);
+// outline circle of radius r around hole i (midpoint algorithm)
+void layer_circle(int i, float r)
+{
+	int cx = get_screen_x(holes.x[i]), cy = get_screen_y(holes.y[i]);
+	int x = r, y = 0, err = 1 - x;
+	Uint32 color = hole_color(i);
 
-		resultop.a += job.op.a;
-		resultop.b += job.op.b;
-		resultop.c += job.op.c;
-		resultop.d += job.op.d;
-		resultop.e += job.op.e;
-		resultop.f += job.op.f;
+	void plot(int px, int py) {
+		if (px >= 0 && py >= 0 && px < 640 && py < 480)
+			hole_layer[px + py*640] = color;
+	}
 
-		resultop_div++;
+	plot(cx, cy);
+	while (x >= y) {
+		plot(cx+x, cy+y); plot(cx-x, cy+y); plot(cx+x, cy-y); plot(cx-x, cy-y);
+		plot(cx+y, cy+x); plot(cx-y, cy+x); plot(cx+y, cy-x); plot(cx-y, cy-x);
+		y++;
+		if (err < 0) {
+			err += 2*y + 1;
+		} else {
+			x--;
+			err += 2*(y-x) + 1;
+		}
 	}
+	dirty_add(cx - r - 1, cy - r - 1, 2*r + 3, 2*r + 3);
+}
 
-	resultop.a /= resultop_div;
-	resultop.b /= resultop_div;
-	resultop.c /= resultop_div;
-	resultop.d /= resultop_div;
-	resultop.e /= resultop_div;
-	resultop.f /= resultop_div;
+/*
+ * Rasterise the holes in the view. Only the cells of the hole index that
+ * overlap the view are visited, so the time depends on the number of
+ * visible holes.
+ */
+void hole_layer_draw()
+{
+	Uint32 background = drilling ? 0x00880000 : 0;
+	float max_r = 0;
+	int i, j, p;
 
-	active_matrixop = resultop;
+	if (!hole_layer) {
+		hole_layer = CHECK(malloc(640*480*sizeof(Uint32)), != NULL);
+		layer_count = CHECK(malloc(640*480*sizeof(uint16_t)), != NULL);
+		layer_undone = CHECK(malloc(640*480*sizeof(uint16_t)), != NULL);
+		layer_hole = CHECK(malloc(640*480*sizeof(int)), != NULL);
+	}
+	memset(layer_count, 0, 640*480*sizeof(uint16_t));
+	memset(layer_undone, 0, 640*480*sizeof(uint16_t));
+	for (i=0; i<holes.tool_count; i++)
+		max_r = fmax(max_r, holes.tools[i].diameter / 2);
+	layer_circles = hole_index.cell_size * view_scale >= VIEW_CIRCLE_SPACING;
 
-	console("New matrices:\n");
-	print_matrixop(&active_matrixop);
+	// visible part of the board (X is mirrored), plus the largest radius
+	float x0 = get_board_x(640) - max_r, x1 = get_board_x(0) + max_r;
+	float y0 = get_board_y(480) - max_r, y1 = get_board_y(0) + max_r;
+	int cx0, cy0, cx1, cy1, cx, cy;
+	hole_grid_cell(&hole_index, x0, y0, &cx0, &cy0);
+	hole_grid_cell(&hole_index, x1, y1, &cx1, &cy1);
 
-	for (a1=adj_list; a1; a1=a2) {
-		a2 = a1->next;
-		free(a1);
+	// pass 0: count the small holes per pixel, pass 1: draw the big ones on top
+	int pass;
+	for (pass=0; pass<2; pass++) {
+		for (cy=cy0; cy<=cy1; cy++)
+		for (cx=cx0; cx<=cx1; cx++) {
+			int c = cx + cy*hole_index.w;
+			for (j=hole_index.cell_start[c]; j<hole_index.cell_start[c+1]; j++) {
+				i = hole_index.items[j];
+				if (holes.x[i] < x0 || holes.x[i] > x1 || holes.y[i] < y0 || holes.y[i] > y1)
+					continue;
+				float r = hole_radius(i);
+				if (r > 0) {
+					if (pass == 1)
+						layer_circle(i, r);
+					continue;
+				}
+				int x = get_screen_x(holes.x[i]), y = get_screen_y(holes.y[i]);
+				if (pass == 1 || x < 0 || y < 0 || x >= 640 || y >= 480)
+					continue;
+				p = x + y*640;
+				if (layer_count[p] == 0)
+					layer_hole[p] = i;
+				if (layer_count[p] < UINT16_MAX)
+					layer_count[p]++;
+				if (!hole_is_done(&holes, i) && layer_undone[p] < UINT16_MAX)
+					layer_undone[p]++;
+			}
+		}
+		if (pass == 0)
+			for (p=0; p<640*480; p++)
+				hole_layer[p] = layer_count[p] ? layer_pixel_color(p) : background;
 	}
 
-	adj_list = NULL;
-	adj_count = 0;
+	hole_layer_valid = 1;
+	hole_layer_drilling = drilling;
 }
 
-int get_screen_x(float x)
+// replot hole i after it was drilled
+void hole_layer_plot(int i)
 {
-	return 620 - ((x-min_x)/(max_x-min_x))*620 + 10;
+	if (!hole_layer_valid)
+		return;
+	screen_needs_update = 1;
+	if (hole_radius(i) > 0) {
+		layer_circle(i, hole_radius(i));
+		return;
+	}
+	int x = get_screen_x(holes.x[i]), y = get_screen_y(holes.y[i]);
+	if (x < 0 || y < 0 || x >= 640 || y >= 480)
+		return;
+	int p = x + y*640;
+	if (layer_undone[p] > 0)
+		layer_undone[p]--;
+	hole_layer[p] = layer_pixel_color(p);
+	dirty_add(x, y, 1, 1);
 }
 
-int get_screen_y(float y)
-{
-	return 450 - ((y-min_y)/(max_y-min_y))*440;
-}
+/*
+ * Rendered text lines, cached by font, colour and content, so that only
+ * new or changed console and status lines are rasterised. The least
+ * recently used line is replaced when the cache is full.
+ */
+#define TEXT_CACHE_SIZE 64
 
-void setpixel(int x, int y, int r, int g, int b)
+struct text_cache_entry {
+	TTF_Font *font;
+	Uint32 color, hash;
+	unsigned int last_used;
+	SDL_Surface *surface;
+	char text[128];
+};
+
+struct text_cache_entry text_cache[TEXT_CACHE_SIZE];
+unsigned int text_cache_clock;
+
+SDL_Surface *render_text(TTF_Font *f, SDL_Color color, const char *text)
 {
-	Uint32 *pixel = screen->pixels;
-	pixel[x + y*640] = r << 16 | g << 8 | b;
+	Uint32 c = color.r << 16 | color.g << 8 | color.b;
+	Uint32 hash = 2166136261u;
+	const char *p;
+	int i, lru = 0;
+
+	for (p=text; *p; p++)
+		hash = (hash ^ (unsigned char)*p) * 16777619u;
+
+	for (i=0; i<TEXT_CACHE_SIZE; i++) {
+		struct text_cache_entry *e = &text_cache[i];
+		if (e->surface && e->hash == hash && e->font == f && e->color == c &&
+				!strcmp(e->text, text)) {
+			e->last_used = ++text_cache_clock;
+			return e->surface;
+		}
+		if (e->last_used < text_cache[lru].last_used)
+			lru = i;
+	}
+
+	SDL_Surface *surface = CHECK(TTF_RenderText_Solid(f, text, color), != NULL);
+	if (p - text >= sizeof(text_cache[0].text))
+		return surface;
+
+	struct text_cache_entry *e = &text_cache[lru];
+	if (e->surface)
+		SDL_FreeSurface(e->surface);
+	e->font = f;
+	e->color = c;
+	e->hash = hash;
+	e->last_used = ++text_cache_clock;
+	e->surface = surface;
+	strcpy(e->text, text);
+	return surface;
 }
 
 void draw_text(int x, int w, int y, TTF_Font *f, SDL_Color color, const char* text)
 {
-	SDL_Surface *text_surface;
-	text_surface = CHECK(TTF_RenderText_Solid(f, text, color), != NULL);
+	SDL_Surface *text_surface = render_text(f, color, text);
 	SDL_Rect drect = text_surface->clip_rect;
 	drect.x = x; drect.y = y;
 	if (w && w > drect.w)
 		drect.x += (w-drect.w)/2;
+	dirty_add(drect.x, drect.y, text_surface->w, text_surface->h);
 	SDL_BlitSurface(text_surface, NULL, screen, &drect);
-	SDL_FreeSurface(text_surface);
+	if (strlen(text) >= sizeof(text_cache[0].text))
+		SDL_FreeSurface(text_surface);
 }
 
 void draw_screen()
@@ -430,14 +2717,26 @@ void draw_screen()
 		return;
 	screen_needs_update = 0;
 
-	if (drilling) {
-		Uint32 *pixel = screen->pixels;
-		for (i=0; i<640*480; i++) {
-			*pixel = 0x00880000;
-			pixel++;
+	// restore what the last frame drew over the hole layer
+	SDL_Rect flush_rects[2*MAX_DIRTY_RECTS];
+	int flush_count = 0;
+	if (!hole_layer_valid || hole_layer_drilling != drilling) {
+		hole_layer_draw();
+		dirty_full = 1;
+	}
+	if (dirty_full) {
+		memcpy(screen->pixels, hole_layer, 640*480*sizeof(Uint32));
+	} else {
+		for (i=0; i<dirty_count; i++) {
+			SDL_Rect *r = &dirty_rects[i];
+			for (y=r->y; y<r->y+r->h; y++)
+				memcpy((Uint32*)screen->pixels + y*640 + r->x, hole_layer + y*640 + r->x,
+						r->w * sizeof(Uint32));
+			flush_rects[flush_count++] = *r;
 		}
-	} else
-		memset(screen->pixels, 0, 640*480*4);
+	}
+	int full = dirty_full;
+	dirty_count = dirty_full = 0;
 
 	if (console_gui) {
 		for (i=1; i<=CONSIZE; i++) {
@@ -450,19 +2749,6 @@ void draw_screen()
 		}
 	}
 
-	struct pos *p;
-
-	for (p=drill_list; p; p=p->next) {
-		if (p->done)
-			setpixel(get_screen_x(p->x), get_screen_y(p->y), 0x88, 0x88, 0x88);
-		else
-			setpixel(get_screen_x(p->x), get_screen_y(p->y), 0xff, 0xff, 0xff);
-	}
-	for (p=mark_list; p; p=p->next)
-		setpixel(get_screen_x(p->x), get_screen_y(p->y), 0x00, 0xff, 0xff);
-	for (p=mount_list; p; p=p->next)
-		setpixel(get_screen_x(p->x), get_screen_y(p->y), 0xff, 0x88, 0x00);
-
 	static const char *current_cursor[3][13] = {
 		{
 			"      #      ",
@@ -514,6 +2800,7 @@ void draw_screen()
 	if (current_autopos) {
 		x = get_screen_x(current_x)-6;
 		y = get_screen_y(current_y)-6;
+		dirty_add(x, y, 13, 13);
 		for (i=0; i<13; i++)
 		for (j=0; j<13; j++)
 			if (current_cursor[current_z][j][i] != ' ')
@@ -532,6 +2819,7 @@ void draw_screen()
 
 	x = get_screen_x(target_x)-3;
 	y = get_screen_y(target_y)-3;
+	dirty_add(x, y, 7, 7);
 	for (i=0; i<7; i++)
 	for (j=0; j<7; j++)
 		if (target_cursor[j][i] != ' ')
@@ -551,22 +2839,45 @@ void draw_screen()
 	for (adj=adj_list; adj; adj=adj->next) {
 		x = get_screen_x(adj->xf)-3;
 		y = get_screen_y(adj->yf)-3;
+		dirty_add(x, y, 7, 7);
 		for (i=0; i<7; i++)
 		for (j=0; j<7; j++)
-			if (adj_marker[j][i] != ' ')
+			if (adj_marker[j][i] == ' ')
+				continue;
+			else if (adj->outlier)
+				setpixel(x+i, y+j, 0xff, 0x00, 0x00);
+			else
 				setpixel(x+i, y+j, 0x00, 0xff, 0xff);
 	}
 
 	char strbuf[512];
-	snprintf(strbuf, 512, "M-Step: %f (%d), CNC-X: %f, CNC-Y: %f",
-			manual_step_size, manual_step_index, cnc_x, cnc_y);
+	int len = snprintf(strbuf, 512, "M-Step: %f (%d), CNC-X: %f, CNC-Y: %f",
+			manual_step_size, manual_step_index, nm_to_mm(cnc_x), nm_to_mm(cnc_y));
+	if (drill_tool >= 0 && drill_tool < holes.tool_count)
+		snprintf(strbuf+len, 512-len, ", T%d: %.2f mm", holes.tools[drill_tool].number,
+				holes.tools[drill_tool].diameter);
 	draw_text(0, 0, 460, font, textcolor2, strbuf);
 
-	SDL_UpdateRect(screen, 0, 0, 640, 480);
+	if (drill_prompt[0]) {
+		SDL_Rect prect = { 40, 210, 560, 40 };
+		SDL_FillRect(screen, &prect, SDL_MapRGB(screen->format, 160, 0, 0));
+		dirty_add(prect.x, prect.y, prect.w, prect.h);
+		draw_text(0, 640, 220, font, textcolor2, drill_prompt);
+	}
+
+	if (full || dirty_full) {
+		SDL_UpdateRect(screen, 0, 0, 640, 480);
+		return;
+	}
+	memcpy(flush_rects + flush_count, dirty_rects, dirty_count * sizeof(SDL_Rect));
+	SDL_UpdateRects(screen, flush_count + dirty_count, flush_rects);
 }
 
 void draw_move_line(float x1f, float y1f, float x2f, float y2f)
 {
+	if (!screen)
+		return;
+
 	int x1 = get_screen_x(x1f);
 	int y1 = get_screen_y(y1f);
 	int x2 = get_screen_x(x2f);
@@ -585,154 +2896,505 @@ void draw_move_line(float x1f, float y1f, float x2f, float y2f)
 		x+=xd/steps;
 		y+=yd/steps;
 	}
-	
-	SDL_UpdateRect(screen, 0, 0, 640, 480);
+
+	// stays until the next frame restores it from the hole layer
+	int rx = x1 < x2 ? x1 : x2, ry = y1 < y2 ? y1 : y2;
+	int rw = abs(x1-x2) + 1, rh = abs(y1-y2) + 1;
+	dirty_add(rx, ry, rw, rh);
+	if (rx >= 0 && ry >= 0 && rx+rw <= 640 && ry+rh <= 480)
+		SDL_UpdateRect(screen, rx, ry, rw, rh);
+}
+
+#ifdef WIN32
+static HANDLE hComm;
+#else
+static int tts_fd = -1;
+#endif
+
+/*
+ * All serial I/O is done by a background thread (gcode_thread) that owns
+ * the tty. The GUI talks to it through two lock-free single-producer
+ * single-consumer rings: gcode_cmd_ring carries G-code lines (and markers)
+ * to the thread, gcode_msg_ring carries console text, reached markers and
+ * abort notifications back. Every command carries the state of the head
+ * model after it, so an abort can roll the model back to what has really
+ * been sent to the CNC.
+ */
+struct spsc_ring {
+	volatile unsigned int head, tail;
+	int size, elsize;
+	char *data;
+};
+
+struct gcode_state {
+	int64_t cnc_x, cnc_y, cnc_z;
+	float current_x, current_y;
+	int current_z;
+};
+
+struct gcode_cmd {
+	int len;	// 0 for markers
+	int tag;
+	struct gcode_state state;
+	char line[128];
+};
+
+#define GCODE_MSG_TEXT 0
+#define GCODE_MSG_MARKER 1
+#define GCODE_MSG_ABORTED 2
+#define GCODE_MSG_ANSWER 3	// like TEXT, only printed with -v without GUI
+
+struct gcode_msg {
+	int type;
+	int tag;
+	struct gcode_state state;
+	char text[128];
+};
+
+struct spsc_ring gcode_cmd_ring, gcode_msg_ring;
+SDL_sem *gcode_cmd_sem;
+volatile int gcode_pending, gcode_abort_request, gcode_event_pending;
+volatile int gcode_errors;	// lines the CNC answered with "error"
+volatile int gcode_quit_request;
+SDL_Thread *gcode_thread_handle;
+
+/*
+ * Streaming mode ("character counting"): instead of waiting for the "ok"
+ * of every line, we keep sending as long as the sum of the lengths of all
+ * unacknowledged lines fits into the RX buffer of the controller. Every
+ * "ok" or "error" answer retires the oldest line in flight. Only used by
+ * the transport thread.
+ */
+struct gcode_cmd gcode_inflight[GCODE_INFLIGHT_MAX];
+int gcode_inflight_first, gcode_inflight_count, gcode_inflight_bytes;
+struct gcode_state gcode_sent_state;
+
+void spsc_ring_init(struct spsc_ring *r, int size, int elsize)
+{
+	r->head = r->tail = 0;
+	r->size = size;
+	r->elsize = elsize;
+	r->data = CHECK(malloc(size*elsize), != NULL);
+}
+
+int spsc_ring_put(struct spsc_ring *r, const void *el)
+{
+	unsigned int head = r->head;
+	if (head - r->tail == r->size)
+		return 0;
+	memcpy(r->data + (head % r->size)*r->elsize, el, r->elsize);
+	__sync_synchronize();
+	r->head = head + 1;
+	return 1;
+}
+
+int spsc_ring_get(struct spsc_ring *r, void *el)
+{
+	unsigned int tail = r->tail;
+	if (r->head == tail)
+		return 0;
+	__sync_synchronize();
+	memcpy(el, r->data + (tail % r->size)*r->elsize, r->elsize);
+	__sync_synchronize();
+	r->tail = tail + 1;
+	return 1;
+}
+
+void gcode_post(int type, int tag, const char *text)
+{
+	struct gcode_msg msg = { type, tag, gcode_sent_state };
+	snprintf(msg.text, sizeof(msg.text), "%s", text);
+	while (!spsc_ring_put(&gcode_msg_ring, &msg)) {
+		// nobody reads the messages any more
+		if (gcode_quit_request)
+			return;
+		SDL_Delay(1);
+	}
+	if (!__sync_lock_test_and_set(&gcode_event_pending, 1)) {
+		SDL_Event event = { };
+		event.type = SDL_USEREVENT;
+		SDL_PushEvent(&event);
+	}
+}
+
+void gcode_open()
+{
+#ifdef WIN32
+	hComm = CHECK(CreateFile(tts_device, GENERIC_READ | GENERIC_WRITE, 0, 0, OPEN_EXISTING, 0, 0), != INVALID_HANDLE_VALUE);
+
+	DCB dcb;
+	FillMemory(&dcb, sizeof(dcb), 0);
+	dcb.DCBlength = sizeof(dcb);
+	CHECK(BuildCommDCB("38400,n,8,1", &dcb), != 0);
+	CHECK(SetCommState(hComm, &dcb), != 0);
+
+	COMMTIMEOUTS ct;
+	FillMemory(&ct, sizeof(ct), 0);
+	ct.ReadIntervalTimeout = MAXDWORD;
+	ct.ReadTotalTimeoutMultiplier = MAXDWORD;
+	ct.ReadTotalTimeoutConstant = 100;
+	CHECK(SetCommTimeouts(hComm, &ct), != 0);
+#else
+	tts_fd = CHECK(open(tts_device, O_RDWR | O_NOCTTY), >= 0);
+
+	struct termios newtio = { };
+	newtio.c_cflag = B38400 | CS8 | CREAD;
+	newtio.c_iflag = IGNPAR;
+	newtio.c_oflag = 0;
+	newtio.c_lflag = 0;
+	newtio.c_cc[VMIN]=1;
+	newtio.c_cc[VTIME]=0;
+	tcflush(tts_fd, TCIFLUSH);
+	tcsetattr(tts_fd, TCSANOW, &newtio);
+#endif
+}
+
+void gcode_write(const char *buffer, int len)
+{
+	int written = 0;
+#ifdef WIN32
+	while (written < len) {
+		DWORD wr_ret;
+		CHECK(WriteFile(hComm, buffer+written, len-written, &wr_ret, NULL), != 0);
+		CHECK(wr_ret, >0);
+		written += wr_ret;
+	}
+#else
+	while (written < len)
+		written += CHECK(write(tts_fd, buffer+written, len-written), > 0);
+#endif
+}
+
+// returns 1 when a complete line has been read, 0 on timeout
+int gcode_read_line(char *buffer, int size)
+{
+	static char line[514];
+	static int len;
+#ifdef WIN32
+	DWORD rd_ret;
+	do {
+		CHECK(ReadFile(hComm, line+len, 1, &rd_ret, NULL), != 0);
+		if (rd_ret == 0)
+			return 0;
+		len++;
+	} while (line[len-1] != '\n' && len < 512);
+#else
+	static char rdbuf[512];
+	static int rdbuf_pos, rdbuf_len;
+	do {
+		if (rdbuf_pos == rdbuf_len) {
+			struct pollfd pfd = { tts_fd, POLLIN, 0 };
+			if (CHECK(poll(&pfd, 1, 100), >= 0) == 0)
+				return 0;
+			rdbuf_len = CHECK(read(tts_fd, rdbuf, sizeof(rdbuf)), > 0);
+			rdbuf_pos = 0;
+		}
+		line[len++] = rdbuf[rdbuf_pos++];
+	} while (line[len-1] != '\n' && len < 512);
+#endif
+	line[len] = 0;
+	snprintf(buffer, size, "%s", line);
+	len = 0;
+	return 1;
+}
+
+// markers at the head of the inflight queue are reached when all lines before them are acknowledged
+void gcode_retire_markers()
+{
+	while (gcode_inflight_count > 0 && gcode_inflight[gcode_inflight_first].len == 0) {
+		struct gcode_cmd *gi = &gcode_inflight[gcode_inflight_first];
+		gcode_post(GCODE_MSG_MARKER, gi->tag, "");
+		gcode_inflight_first = (gcode_inflight_first+1) % GCODE_INFLIGHT_MAX;
+		gcode_inflight_count--;
+		__sync_fetch_and_sub(&gcode_pending, 1);
+	}
+}
+
+void gcode_handle_answer(const char *buffer)
+{
+	struct gcode_cmd *gi = &gcode_inflight[gcode_inflight_first];
+	char text[128];
+
+	snprintf(text, sizeof(text), "Answer from CNC: %s", buffer);
+	gcode_post(GCODE_MSG_ANSWER, -1, text);
+
+	if (!strncmp(buffer, "error", 5)) {
+		__sync_fetch_and_add(&gcode_errors, 1);
+		snprintf(text, sizeof(text), "CNC rejected GCODE: %s\n", gi->line);
+		gcode_post(GCODE_MSG_TEXT, -1, text);
+	} else if (strcmp(buffer, "ok\r\n") && strncmp(buffer, "ok:", 3)) {
+		gcode_post(GCODE_MSG_TEXT, -1, "That isn't what was expected. (reading next line)\n");
+		return;
+	}
+
+	gcode_inflight_first = (gcode_inflight_first+1) % GCODE_INFLIGHT_MAX;
+	gcode_inflight_bytes -= gi->len;
+	gcode_inflight_count--;
+	__sync_fetch_and_sub(&gcode_pending, 1);
+	gcode_retire_markers();
+}
+
+int gcode_thread(void *unused)
+{
+	struct gcode_cmd cmd;
+	int have_cmd = 0;
+	char buffer[514];
+
+	gcode_open();
+
+	while (1)
+	{
+		// quitting: close the port without waiting for the answers in flight
+		if (gcode_quit_request) {
+#ifdef WIN32
+			CloseHandle(hComm);
+#else
+			close(tts_fd);
+#endif
+			return 0;
+		}
+
+		if (gcode_abort_request) {
+			int dropped = have_cmd;
+			while (spsc_ring_get(&gcode_cmd_ring, &cmd))
+				dropped++;
+			have_cmd = 0;
+			__sync_fetch_and_sub(&gcode_pending, dropped);
+			gcode_abort_request = 0;
+			gcode_post(GCODE_MSG_ABORTED, -1, "");
+		}
+
+		if (!have_cmd)
+			have_cmd = spsc_ring_get(&gcode_cmd_ring, &cmd);
+
+		// in blocking mode there is never more than one line in flight, markers need a slot too
+		if (have_cmd && gcode_inflight_count < GCODE_INFLIGHT_MAX &&
+				(cmd.len == 0 || gcode_inflight_count == 0 ||
+				 (gcode_rxbuf_size > 0 && gcode_inflight_bytes + cmd.len <= gcode_rxbuf_size)))
+		{
+			if (cmd.len > 0) {
+				snprintf(buffer, 512, "%s\n", cmd.line);
+				gcode_write(buffer, cmd.len);
+				gcode_sent_state = cmd.state;
+			}
+			gcode_inflight[(gcode_inflight_first + gcode_inflight_count) %
+					GCODE_INFLIGHT_MAX] = cmd;
+			gcode_inflight_bytes += cmd.len;
+			gcode_inflight_count++;
+			gcode_retire_markers();
+			have_cmd = 0;
+			continue;
+		}
+
+		if (gcode_inflight_count > 0) {
+			if (gcode_read_line(buffer, 512))
+				gcode_handle_answer(buffer);
+			continue;
+		}
+
+		if (!have_cmd)
+			SDL_SemWaitTimeout(gcode_cmd_sem, 100);
+	}
+
+	return 0;
+}
+
+void gcode_queue(struct gcode_cmd *cmd)
+{
+	if (!gcode_thread_handle) {
+		spsc_ring_init(&gcode_cmd_ring, GCODE_QUEUE_SIZE, sizeof(struct gcode_cmd));
+		spsc_ring_init(&gcode_msg_ring, GCODE_QUEUE_SIZE, sizeof(struct gcode_msg));
+		gcode_cmd_sem = CHECK(SDL_CreateSemaphore(0), != NULL);
+		gcode_thread_handle = CHECK(SDL_CreateThread(gcode_thread, NULL), != NULL);
+	}
+
+	cmd->state.cnc_x = cnc_x;
+	cmd->state.cnc_y = cnc_y;
+	cmd->state.cnc_z = cnc_z;
+	cmd->state.current_x = current_x;
+	cmd->state.current_y = current_y;
+	cmd->state.current_z = current_z;
+
+	__sync_fetch_and_add(&gcode_pending, 1);
+	while (!spsc_ring_put(&gcode_cmd_ring, cmd)) {
+		gcode_poll();
+		SDL_Delay(1);
+	}
+	SDL_SemPost(gcode_cmd_sem);
+}
+
+// G-code file output (-g): lines are collected in a large buffer
+char *gcode_out_buf;
+int gcode_out_len;
+FILE *gcode_out;
+
+void gcode_out_flush()
+{
+	CHECK(fwrite(gcode_out_buf, 1, gcode_out_len, gcode_out), == (size_t)gcode_out_len);
+	gcode_out_len = 0;
+}
+
+void gcode_out_line(const char *line)
+{
+	int len = strlen(line);
+	if (gcode_out_len + len + 1 > GCODE_OUT_BUFSIZE)
+		gcode_out_flush();
+	memcpy(gcode_out_buf + gcode_out_len, line, len);
+	gcode_out_buf[gcode_out_len + len] = '\n';
+	gcode_out_len += len + 1;
+}
+
+void execute_gcode(const char *line)
+{
+	if (gcode_out) {
+		console_move("GCODE: %s\n", line);
+		gcode_out_line(line);
+		return;
+	}
+
+	struct gcode_cmd cmd = { };
+	cmd.tag = -1;
+	cmd.len = snprintf(cmd.line, sizeof(cmd.line), "%s", line) + 1;
+	console_move("Sending GCODE (len=%d): %s\n", cmd.len+1, cmd.line);
+	gcode_queue(&cmd);
+}
+
+// the tag is passed back to drill_marker_reached() when the CNC has acknowledged all lines before the marker
+void gcode_marker(int tag)
+{
+	if (gcode_out)
+		return;
+
+	struct gcode_cmd cmd = { };
+	cmd.tag = tag;
+	gcode_queue(&cmd);
+}
+
+// drop all lines that have not been sent to the CNC yet
+void gcode_abort()
+{
+	gcode_abort_request = 1;
+}
+
+// handle all messages from the transport thread (GUI thread only)
+void gcode_poll()
+{
+	struct gcode_msg msg;
+
+	gcode_event_pending = 0;
+	__sync_synchronize();
+
+	while (gcode_msg_ring.data && spsc_ring_get(&gcode_msg_ring, &msg)) {
+		if (msg.type == GCODE_MSG_TEXT)
+			console("%s", msg.text);
+		if (msg.type == GCODE_MSG_ANSWER)
+			console_move("%s", msg.text);
+		if (msg.type == GCODE_MSG_MARKER)
+			drill_marker_reached(msg.tag);
+		if (msg.type == GCODE_MSG_ABORTED) {
+			cnc_x = msg.state.cnc_x;
+			cnc_y = msg.state.cnc_y;
+			cnc_z = msg.state.cnc_z;
+			current_x = msg.state.current_x;
+			current_y = msg.state.current_y;
+			current_z = msg.state.current_z;
+			drill_aborted();
+		}
+	}
+}
+
+// wait until the CNC has acknowledged all lines queued so far
+void gcode_sync()
+{
+	while (gcode_pending > 0) {
+		gcode_poll();
+		if (!blind_gcode_mode)
+			draw_screen();
+		SDL_Delay(1);
+	}
+	gcode_poll();
+}
+
+/*
+ * Stop the transport thread when quitting. Waits for the CNC to
+ * acknowledge the lines sent so far, but at most GCODE_QUIT_TIMEOUT ms
+ * and only until the window is closed (or 'q' pressed) again, so a CNC
+ * that stopped answering can't hang the GUI.
+ */
+void gcode_quit()
+{
+	double t0 = get_time();
+	SDL_Event event;
+
+	while (gcode_pending > 0 && get_time() - t0 < GCODE_QUIT_TIMEOUT / 1000.0) {
+		gcode_poll();
+		draw_screen();
+		if (SDL_PollEvent(&event) && (event.type == SDL_QUIT ||
+				(event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_q)))
+			break;
+		SDL_Delay(1);
+	}
+	if (gcode_pending > 0)
+		console("The CNC doesn't answer, quitting without waiting.\n");
+
+	if (gcode_thread_handle) {
+		gcode_quit_request = 1;
+		SDL_WaitThread(gcode_thread_handle, NULL);
+	}
 }
 
-void move_cnc_head_gcode(int z_state, int z_notxy, int low_speed)
-{
-	static int initialized = 0;
-#ifdef WIN32
-	static HANDLE hComm;
-#else
-	static FILE *tts = NULL;
-#endif
-	char buffer[514];
+int gcode_initialized;
 
-	void execute_gcode()
+void gcode_init()
+{
+	if (!gcode_initialized)
 	{
-		int len = strlen(buffer);
-		console("Sending GCODE (len=%d): %s\n", len+2, buffer);
-		// buffer[len++] = '\r';
-		buffer[len++] = '\n';
-		buffer[len] = 0;
-		
-#ifdef WIN32
-		int written = 0;
-		while (written < len) {
-			DWORD wr_ret;
-			CHECK(WriteFile(hComm, buffer+written, len-written, &wr_ret, NULL), != 0);
-			CHECK(wr_ret, >0);
-			written += wr_ret;
-		}
-#else
-		fprintf(tts, "%s", buffer);
-		fflush(tts);
+		execute_gcode("G90");
+		execute_gcode("G92");
 
-		if (blind_gcode_mode)
-			return;
-#endif
-read_next_line:
-		console("Answer from CNC: ");
-		draw_screen();
-#ifdef WIN32
-		len = 0;
-		do {
-			DWORD rd_ret;
-			int update_screen_text = 1;
-retry_read_file:
-			CHECK(ReadFile(hComm, buffer+len, 1, &rd_ret, NULL), != 0);
-			if (rd_ret == 0) {
-				if (update_screen_text)
-					draw_screen();
-				update_screen_text = 0;
-				goto retry_read_file;
-			}
-			CHECK(rd_ret, >0);
-			if (buffer[len] == '\r')
-				console("\\r");
-			else if (buffer[len] == '\n')
-				console("\\n");
-			else if (buffer[len] < ' ')
-				console("\\%03o", (unsigned char)buffer[len]);
-			else
-				console("%c", buffer[len]);
-			buffer[++len] = 0;
-		} while (buffer[len-1] != '\n' && len < 500);
-		console("\n");
-		draw_screen();
-#else
-		CHECK(fgets(buffer, 512, tts), == buffer);
-		console("%s", buffer);
-#endif
-		if(strcmp(buffer, "ok\r\n") && strncmp(buffer, "ok:", 3)) {
-			console("That isn't what was expected. (reading next line)\n");
-			goto read_next_line;
-		}
+		gcode_initialized = 1;
 	}
+}
 
-	if (!initialized)
-	{
-#ifdef WIN32
-		hComm = CHECK(CreateFile(tts_device, GENERIC_READ | GENERIC_WRITE, 0, 0, OPEN_EXISTING, 0, 0), != INVALID_HANDLE_VALUE);
-
-		DCB dcb;
-		FillMemory(&dcb, sizeof(dcb), 0);
-		dcb.DCBlength = sizeof(dcb);
-		CHECK(BuildCommDCB("38400,n,8,1", &dcb), != 0);
-		CHECK(SetCommState(hComm, &dcb), != 0);
-
-		COMMTIMEOUTS ct;
-		FillMemory(&ct, sizeof(ct), 0);
-		ct.ReadIntervalTimeout = MAXDWORD;
-		ct.ReadTotalTimeoutMultiplier = MAXDWORD;
-		ct.ReadTotalTimeoutConstant = 100;
-		CHECK(SetCommTimeouts(hComm, &ct), != 0);
-#else
-		if (blind_gcode_mode) {
-			tts = CHECK(fopen(tts_device, "w"), != NULL);
-		} else {
-			tts = CHECK(fopen(tts_device, "r+"), != NULL);
-
-			int comfd = fileno(tts);
-			struct termios newtio = { };
-			newtio.c_cflag = B38400 | CS8 | CREAD;
-			newtio.c_iflag = IGNPAR;
-			newtio.c_oflag = 0;
-			newtio.c_lflag = 0;
-			newtio.c_cc[VMIN]=1;
-			newtio.c_cc[VTIME]=0;
-			tcflush(comfd, TCIFLUSH);
-			tcsetattr(comfd, TCSANOW, &newtio);
-		}
-#endif
+void move_cnc_head_gcode(int z_state, int z_notxy, int low_speed)
+{
+	char buffer[514];
 
-		snprintf(buffer, 512, "G90");
-		execute_gcode();
-		snprintf(buffer, 512, "G92");
-		execute_gcode();
+	gcode_init();
 
-		initialized = 1;
+	// cancel a modal canned drill cycle before any other move
+	if (gcode_cycle_active) {
+		execute_gcode("G80");
+		gcode_cycle_active = 0;
 	}
 
 	if (z_state == Z_STATE_HOME) {
+		cnc_x = cnc_y = cnc_z = 0;
+		current_z = 0;
 #if 1
-		snprintf(buffer, 512, "G1 Z0 F%f",
-				low_speed ? (float)FEEDRATE_LOW : (float)FEEDRATE_HIGH);
-		execute_gcode();
-		snprintf(buffer, 512, "G1 X0 Y0 F%f",
-				low_speed ? (float)FEEDRATE_LOW : (float)FEEDRATE_HIGH);
-		execute_gcode();
+		execute_gcode("G0 Z0");
+		execute_gcode("G0 X0 Y0");
 #else
 		snprintf(buffer, 512, "G90");
-		execute_gcode();
+		execute_gcode(buffer);
 		snprintf(buffer, 512, "G30 Y0 X0 Z0 F%f", (float)FEEDRATE_HIGH);
-		execute_gcode();
+		execute_gcode(buffer);
 #endif
-		cnc_x = cnc_y = cnc_z = 0;
-		current_z = 0;
 		return;
 	}
 
 	if (z_state == Z_STATE_SETHOME) {
-		snprintf(buffer, 512, "G92 X%f Y%f Z%d", current_x, current_y, current_z);
-		execute_gcode();
+		char *p = buffer + sprintf(buffer, "G92");
+		p = gcode_word(p, 'X', mm_to_nm(current_x));
+		p = gcode_word(p, 'Y', mm_to_nm(current_y));
+		sprintf(p, " Z%d", current_z);
 		cnc_x = cnc_y = cnc_z = 0;
 		current_z = 0;
+		execute_gcode(buffer);
 		return;
 	}
 
-	float z = Z_VALUE_UP;
+	int64_t z = Z_VALUE_UP;
 	if (z_state == Z_STATE_UP)
 		z = Z_VALUE_UP;
 	if (z_state == Z_STATE_MID)
@@ -747,93 +3409,625 @@ retry_read_file:
 		}
 	}
 
+	// travel is rapid, plunge and retract use the feeds of the current tool
+	struct tool_info *t = holes.tool_count && drill_tool >= 0 ? &holes.tools[drill_tool] : NULL;
+	float feed = 0;
+	if (z_notxy && z_state == Z_STATE_DOWN && low_speed)
+		feed = t ? t->plunge_feed : FEEDRATE_LOW;
+	else if (z_notxy && current_z == Z_STATE_DOWN)
+		feed = t ? t->retract_feed : FEEDRATE_HIGH;
+	else if (low_speed)
+		feed = FEEDRATE_LOW;
+
+	char *p = buffer + sprintf(buffer, "%s", feed ? "G1" : "G0");
 	if (z_notxy) {
-		snprintf(buffer, 512, "G1 Z%f F%f", z,
-				low_speed ? (float)FEEDRATE_LOW : (float)FEEDRATE_HIGH);
+		p = gcode_word(p, 'Z', z);
 	} else {
-		snprintf(buffer, 512, "G1 X%f Y%f F%f", cnc_x, cnc_y,
-				low_speed ? (float)FEEDRATE_LOW : (float)FEEDRATE_HIGH);
+		p = gcode_word(p, 'X', cnc_x);
+		p = gcode_word(p, 'Y', cnc_y);
 	}
-	execute_gcode();
+	if (feed)
+		gcode_word(p, 'F', mm_to_nm(feed));
 	current_z = z_state;
+	execute_gcode(buffer);
 }
 
-void move_cnc_head_setpos(float x, float y)
+// set the machine position for the board position x/y, taken from the cache if that is hole i (i >= 0)
+void move_cnc_head_setpos(float x, float y, int i)
 {
-	struct transform_job tj = { };
-	tj.xf = x;
-	tj.yf = y;
-	tj.op = active_matrixop;
-	transform(&tj);
-	cnc_x = tj.xp;
-	cnc_y = tj.yp;
+	if (i >= 0) {
+		cnc_x = holes.mx[i];
+		cnc_y = holes.my[i];
+	} else {
+		int64_t xf = mm_to_nm(x), yf = mm_to_nm(y);
+		transform_batch(&active_matrixop, &active_correction, &xf, &yf, &cnc_x, &cnc_y, 1);
+	}
 }
 
 void move_cnc_head_rel(float xd, float yd, float zd)
 {
 	if (fabs(xd) > 10 || fabs(yd) > 10 || current_z == Z_STATE_UP) {
 		console("Relative move (fast): X_delta=%f, Y_delta=%f\n", xd, yd);
-		cnc_z += zd;
+		cnc_z += mm_to_nm(zd);
 		move_cnc_head_gcode(Z_STATE_UP, 1, 0);
-		cnc_x += xd;
-		cnc_y += yd;
+		cnc_x += mm_to_nm(xd);
+		cnc_y += mm_to_nm(yd);
 		move_cnc_head_gcode(Z_STATE_UP, 0, 0);
 	} else {
 		console("Relative move (slow): X_delta=%f, Y_delta=%f\n", xd, yd);
-		cnc_z += zd;
+		cnc_z += mm_to_nm(zd);
 		move_cnc_head_gcode(Z_STATE_MID, 1, 0);
-		cnc_x += xd;
-		cnc_y += yd;
+		cnc_x += mm_to_nm(xd);
+		cnc_y += mm_to_nm(yd);
 		move_cnc_head_gcode(Z_STATE_MID, 0, 1);
 	}
 	screen_needs_update = 1;
-	draw_screen();
 }
 
-void move_cnc_head(float x, float y, int z)
+// move the head to the board position x/y (hole i, or -1 if it isn't a hole)
+void move_cnc_head(float x, float y, int i, int z)
 {
-	if ((x != current_x || y != current_y || z == Z_STATE_UP) && current_z != Z_STATE_UP)
+	int64_t old_x = cnc_x, old_y = cnc_y;
+
+	move_cnc_head_setpos(x, y, i);
+	if ((cnc_x != old_x || cnc_y != old_y || z == Z_STATE_UP) && current_z != Z_STATE_UP)
 	{
-		console("Moving head up.\n");
+		int64_t new_x = cnc_x, new_y = cnc_y;
+		console_move("Moving head up.\n");
+		cnc_x = old_x;
+		cnc_y = old_y;
 		move_cnc_head_gcode(Z_STATE_UP, 1, 0);
+		cnc_x = new_x;
+		cnc_y = new_y;
 		screen_needs_update = 1;
-		draw_screen();
 	}
 
-	console("Moving head to X=%f, Y=%f.\n", x, y);
+	console_move("Moving head to X=%f, Y=%f.\n", x, y);
 	draw_move_line(current_x, current_y, x, y);
-	move_cnc_head_setpos(x, y);
+	current_x = x;
+	current_y = y;
 	move_cnc_head_gcode(Z_STATE_UP, 0, 0);
 	move_cnc_head_gcode(Z_STATE_UP, 1, 0);
 	screen_needs_update = 1;
-	current_x = x;
-	current_y = y;
-	draw_screen();
 
 	if (z == Z_STATE_DOWN) {
-		console("Moving head down to drill position.\n");
+		console_move("Moving head down to drill position.\n");
 		move_cnc_head_gcode(Z_STATE_MID, 1, 0);
 		move_cnc_head_gcode(z, 1, 1);
 		screen_needs_update = 1;
-		draw_screen();
 	}
 
 	if (z == Z_STATE_MID || z == Z_STATE_DOWN) {
-		console("Moving head down to mid position.\n");
+		console_move("Moving head down to mid position.\n");
 		move_cnc_head_gcode(Z_STATE_MID, 1, 0);
 		screen_needs_update = 1;
-		draw_screen();
 	}
 }
 
+/*
+ * Drill one hole with the drill cycle selected with -d. The canned cycles
+ * start and end at the up plane (G98), use the mid plane as R and the
+ * down plane as Z, and are cancelled with G80 by the next other move.
+ *
+ * If hop is set the next hole is closer than hop_distance, so the head
+ * only retracts to the mid plane (G99 for the canned cycles) and moves
+ * there to the next hole.
+ */
+void drill_hole(int i, int hop)
+{
+	float x = holes.x[i], y = holes.y[i];
+	char buffer[256];
+
+	if (!drilling_ok || !current_autopos ||
+			(drill_cycle == DRILL_CYCLE_LEGACY && !hop && current_z != Z_STATE_MID)) {
+		move_cnc_head(x, y, i, Z_STATE_DOWN);
+		move_cnc_head(x, y, i, Z_STATE_UP);
+		return;
+	}
+
+	if (current_z == Z_STATE_DOWN || (current_z == Z_STATE_MID && !gcode_cycle_active &&
+			hypot(x - current_x, y - current_y) >= hop_distance))
+		move_cnc_head_gcode(Z_STATE_UP, 1, 0);
+
+	console_move("Drilling at X=%f, Y=%f.\n", x, y);
+	draw_move_line(current_x, current_y, x, y);
+	move_cnc_head_setpos(x, y, i);
+	current_x = x;
+	current_y = y;
+	screen_needs_update = 1;
+	if (hop)
+		hop_count++;
+
+	if (drill_cycle == DRILL_CYCLE_LEGACY || drill_cycle == DRILL_CYCLE_EXPAND) {
+		move_cnc_head_gcode(current_z, 0, 0);
+		if (current_z != Z_STATE_MID)
+			move_cnc_head_gcode(Z_STATE_MID, 1, 0);
+		move_cnc_head_gcode(Z_STATE_DOWN, 1, 1);
+		move_cnc_head_gcode(hop ? Z_STATE_MID : Z_STATE_UP, 1, 0);
+		return;
+	}
+
+	gcode_init();
+	if (!gcode_cycle_active && current_z != Z_STATE_UP)
+		move_cnc_head_gcode(Z_STATE_UP, 1, 0);
+	gcode_cycle_active = 1;
+	char *p = buffer + sprintf(buffer, "G%d G%d", hop ? 99 : 98,
+			drill_cycle == DRILL_CYCLE_G83 ? 83 : 81);
+	p = gcode_word(p, 'X', cnc_x);
+	p = gcode_word(p, 'Y', cnc_y);
+	p = gcode_word(p, 'Z', Z_VALUE_DOWN);
+	p = gcode_word(p, 'R', Z_VALUE_MID);
+	if (drill_cycle == DRILL_CYCLE_G83)
+		p = gcode_word(p, 'Q', mm_to_nm(peck_depth));
+	gcode_word(p, 'F', mm_to_nm(holes.tools[drill_tool].plunge_feed));
+	current_z = hop ? Z_STATE_MID : Z_STATE_UP;
+	execute_gcode(buffer);
+}
+
+// index of the next hole of the current tool after the given one (-1: none)
+int drill_find_next(int i)
+{
+	struct tool_info *t = &holes.tools[drill_tool];
+	for (; i<t->first+t->count; i++)
+		if (!hole_is_done(&holes, holes.order[i]))
+			return holes.order[i];
+	return -1;
+}
+
+// first tool after the given one that still has holes to drill (-1: none)
+int drill_find_tool(int after)
+{
+	int i, k;
+	for (k=after+1; k<holes.tool_count; k++) {
+		struct tool_info *t = &holes.tools[k];
+		for (i=t->first; i<t->first+t->count; i++)
+			if (!hole_is_done(&holes, holes.order[i]))
+				return k;
+	}
+	return -1;
+}
+
+// ask the operator to mount the bit of tool k, 's' starts drilling with it
+void drill_tool_prompt(int k)
+{
+	struct tool_info *t = &holes.tools[k];
+	snprintf(drill_prompt, sizeof(drill_prompt), "Insert tool T%d (%.3f mm) and press 's'",
+			t->number, t->diameter);
+	console("%s to continue.\n", drill_prompt);
+}
+
+// cancel the drill cycle and retract, unless the last hole already ended up
+void drill_retract()
+{
+	if (current_z != Z_STATE_UP) {
+		move_cnc_head_gcode(Z_STATE_UP, 1, 0);
+	} else if (gcode_cycle_active) {
+		execute_gcode("G80");
+		gcode_cycle_active = 0;
+	}
+}
+
+// keep the G-code queue filled with the next holes of the drilling program
+void drill_step()
+{
+	if (!drilling || drill_tool < 0)
+		return;
+
+	struct tool_info *t = &holes.tools[drill_tool];
+
+	while (drilling && !drill_aborting && drill_next < t->first + t->count && gcode_pending < GCODE_QUEUE_AHEAD) {
+		int h = holes.order[drill_next++];
+		if (hole_is_done(&holes, h))
+			continue;
+		current_autopos = 1;
+		target_x = holes.x[h];
+		target_y = holes.y[h];
+		target_hole = h;
+		int next = drill_find_next(drill_next);
+		drill_hole(h, next >= 0 &&
+				hypot(holes.x[next] - target_x, holes.y[next] - target_y) < hop_distance);
+		gcode_marker(h);
+	}
+
+	if (drilling && !drill_aborting && drill_next == t->first + t->count && gcode_pending == 0) {
+		drilling = 0;
+		screen_needs_update = 1;
+		drill_tool = drill_find_tool(drill_tool);
+		if (drill_tool < 0) {
+			if (!blind_gcode_mode)
+				console("Drilling program finished.\n");
+			if (hop_count)
+				console("%d short hops at the mid plane, %.1f mm Z travel saved.\n",
+						hop_count, hop_count * 2 * nm_to_mm(Z_VALUE_UP - Z_VALUE_MID));
+			hop_count = 0;
+			drill_tool = 0;
+			return;
+		}
+		drill_retract();
+		if (!blind_gcode_mode)
+			drill_tool_prompt(drill_tool);
+	}
+}
+
+/*
+ * Start (or continue) drilling with tool k, from where the head is now.
+ * The tool change is announced with M6; when writing a G-code file (-g)
+ * an M0 pause naming the bit is added so the operator can change it, also
+ * for the first tool (the GUI does the pause otherwise).
+ */
+void drill_start_tool(int k)
+{
+	struct tool_info *t = &holes.tools[k];
+	float x, y;
+	char buffer[64];
+
+	// the file is generated in the planned order, re-plan only when drilling live
+	if (!blind_gcode_mode) {
+		get_head_board_pos(&x, &y);
+		reschedule_tool(k, x, y);
+	}
+
+	// the program starts with the modal setup, then the first tool change
+	gcode_init();
+	if (gcode_tool != t->number) {
+		snprintf(buffer, sizeof(buffer), "T%d M6", t->number);
+		execute_gcode(buffer);
+		if (blind_gcode_mode) {
+			snprintf(buffer, sizeof(buffer), "M0 (insert T%d, %.3f mm)", t->number, t->diameter);
+			execute_gcode(buffer);
+		}
+		gcode_tool = t->number;
+	}
+
+	drill_prompt[0] = 0;
+	drill_tool = k;
+	drill_next = t->first;
+	drilling = 1;
+}
+
+void drill_marker_reached(int tag)
+{
+	if (tag >= 0) {
+		hole_set_done(&holes, tag);
+		hole_layer_plot(tag);
+	}
+}
+
+// stop queueing holes at once, the transport thread drops what is not sent yet
+void drill_abort()
+{
+	drill_aborting = 1;
+	if (gcode_pending > 0)
+		gcode_abort();
+	else
+		drill_aborted();
+}
+
+void drill_aborted()
+{
+	if (!drilling)
+		return;
+	console("Drilling aborted.\n");
+	drilling = 0;
+	drill_aborting = 0;
+	move_cnc_head_gcode(Z_STATE_UP, 1, 0);
+	screen_needs_update = 1;
+}
+
+/*
+ * Generate the complete drilling program as a G-code file (-g), without
+ * GUI. The file pauses with M0 for each tool change.
+ */
+void compile_gcode(const char *filename)
+{
+	int k;
+
+	if (!strcmp(filename, "-")) {
+		gcode_out = stdout;
+	} else {
+		gcode_out = fopen(filename, "w");
+		if (gcode_out == NULL) {
+			console("Can't open %s: %s\n", filename, strerror(errno));
+			exit(1);
+		}
+	}
+	gcode_out_buf = CHECK(malloc(GCODE_OUT_BUFSIZE), != NULL);
+
+	// start every file like after homing
+	cnc_x = cnc_y = cnc_z = 0;
+	current_x = holes.min_x;
+	current_y = holes.min_y;
+	current_z = Z_STATE_UP;
+	gcode_initialized = 0;
+	gcode_cycle_active = 0;
+	gcode_tool = -1;
+	hop_count = 0;
+
+	double t0 = get_time();
+	drilling_ok = 1;
+	for (k = drill_find_tool(-1); k >= 0; k = drill_find_tool(k)) {
+		drill_start_tool(k);
+		while (drilling)
+			drill_step();
+	}
+	drill_retract();
+	execute_gcode("M2");
+
+	gcode_out_flush();
+	CHECK(fflush(gcode_out), == 0);
+	if (gcode_out != stdout)
+		CHECK(fclose(gcode_out), == 0);
+	free(gcode_out_buf);
+	console("G-code written to %s (%.0f ms).\n", filename, (get_time() - t0) * 1000);
+}
+
+/*
+ * Send the complete drilling program to the CNC (-r), without GUI: the
+ * same program as with -g, but through the transport thread with the
+ * "ok" protocol (and -s). The tool changes pause with M0 on the machine.
+ * Returns 1 if the CNC rejected any line.
+ */
+int stream_gcode()
+{
+	int k;
+
+	double t0 = get_time();
+	drilling_ok = 1;
+	for (k = drill_find_tool(-1); k >= 0; k = drill_find_tool(k)) {
+		drill_start_tool(k);
+		while (drilling) {
+			gcode_poll();
+			drill_step();
+			SDL_Delay(1);
+		}
+	}
+	drill_retract();
+	execute_gcode("M2");
+	gcode_sync();
+
+	console("Drilling program sent to %s (%.1f s, %d errors).\n", tts_device,
+			get_time() - t0, gcode_errors);
+	return gcode_errors ? 1 : 0;
+}
+
+#ifndef WIN32
+/*
+ * Batch conversion (-b): the drill files are loaded and ordered on
+ * batch_threads threads, then the G-code files are written one by one
+ * (next to the drill files, with .gcode instead of .drl). The workers
+ * only fill in their jobs, all messages are printed by the main thread.
+ */
+struct batch_job {
+	char *filename;
+	struct hole_table holes;
+	struct order_stats stats;
+	int ok, outside, first_outside;
+	int error;		// errno if the file can't be opened
+	double ms;
+	char *echo;		// messages with -v
+	size_t echo_len;
+};
+
+struct batch_job *batch_jobs;
+int batch_count, batch_next;
+int batch_threads;
+
+int batch_worker(void *unused)
+{
+	while (1) {
+		int i = __sync_fetch_and_add(&batch_next, 1);
+		if (i >= batch_count)
+			return 0;
+
+		struct batch_job *j = &batch_jobs[i];
+		double t = get_time();
+		if (verbose)
+			console_job_buffer = CHECK(open_memstream(&j->echo, &j->echo_len), != NULL);
+		j->ok = load_drlfile(&j->holes, j->filename) == 0;
+		if (j->ok) {
+			order_drill_list(&j->holes, j->holes.min_x, j->holes.min_y, &j->stats);
+			hole_table_transform(&j->holes, &active_matrixop, &active_correction);
+			j->outside = hole_table_check_limits(&j->holes, &j->first_outside);
+			if (j->outside > 0)
+				j->ok = 0;
+		} else
+			j->error = errno;
+		j->ms = (get_time() - t) * 1000;
+		if (console_job_buffer) {
+			CHECK(fclose(console_job_buffer), == 0);
+			console_job_buffer = NULL;
+		}
+	}
+}
+
+void batch_add(const char *filename)
+{
+	batch_jobs = realloc(batch_jobs, sizeof(struct batch_job) * (batch_count+1));
+	memset(&batch_jobs[batch_count], 0, sizeof(struct batch_job));
+	batch_jobs[batch_count++].filename = strdup(filename);
+}
+
+static int batch_compare_names(const void *a, const void *b)
+{
+	return strcmp(((const struct batch_job*)a)->filename, ((const struct batch_job*)b)->filename);
+}
+
+// add a drill file or all *.drl files of a directory
+void batch_add_path(const char *path)
+{
+	struct stat st;
+	if (stat(path, &st) < 0 || !S_ISDIR(st.st_mode)) {
+		batch_add(path);
+		return;
+	}
+
+	DIR *dir = CHECK(opendir(path), != NULL);
+	struct dirent *de;
+	int first = batch_count;
+	while ((de = readdir(dir)) != NULL) {
+		int len = strlen(de->d_name);
+		if (len > 4 && !strcasecmp(de->d_name + len - 4, ".drl")) {
+			char filename[strlen(path) + len + 2];
+			sprintf(filename, "%s/%s", path, de->d_name);
+			batch_add(filename);
+		}
+	}
+	closedir(dir);
+	qsort(batch_jobs + first, batch_count - first, sizeof(struct batch_job), batch_compare_names);
+}
+
+int batch_convert(char **paths, int n)
+{
+	SDL_Thread *threads[batch_threads];
+	double t0 = get_time();
+	int i, failed = 0;
+
+	for (i=0; i<n; i++)
+		batch_add_path(paths[i]);
+	for (i=0; i<batch_threads; i++)
+		threads[i] = CHECK(SDL_CreateThread(batch_worker, NULL), != NULL);
+	for (i=0; i<batch_threads; i++)
+		SDL_WaitThread(threads[i], NULL);
+
+	for (i=0; i<batch_count; i++) {
+		struct batch_job *j = &batch_jobs[i];
+		if (j->echo) {
+			fwrite(j->echo, 1, j->echo_len, stdout);
+			free(j->echo);
+		}
+		if (!j->ok) {
+			failed++;
+			if (j->outside > 0) {
+				console("%s: %d holes are outside of the soft limits, e.g. machine X=%f, Y=%f\n",
+						j->filename, j->outside, nm_to_mm(j->holes.mx[j->first_outside]),
+						nm_to_mm(j->holes.my[j->first_outside]));
+				free(j->holes.arena);
+			} else
+				console("Can't open %s: %s\n", j->filename, strerror(j->error));
+			continue;
+		}
+		int len = strlen(j->filename);
+		char outname[len + 8];
+		strcpy(outname, j->filename);
+		if (len > 4 && !strcasecmp(outname + len - 4, ".drl"))
+			outname[len - 4] = 0;
+		strcat(outname, ".gcode");
+
+		double t = get_time();
+		holes = j->holes;
+		compile_gcode(outname);
+		j->ms += (get_time() - t) * 1000;
+		free(j->holes.arena);
+	}
+
+	printf("%-32s %7s %5s %12s %10s %8s\n", "File", "Holes", "Tools",
+			travel_model->unit[0] == 's' ? "Travel (s)" : "Travel", "Time (s)", "ms");
+	for (i=0; i<batch_count; i++) {
+		struct batch_job *j = &batch_jobs[i];
+		if (!j->ok) {
+			printf("%-32s %7s\n", j->filename, "failed");
+			continue;
+		}
+		printf("%-32s %7d %5d %12.2f ", j->filename, j->holes.order_count,
+				j->stats.tool_changes + (j->holes.order_count > 0), j->stats.len);
+		// the time is only estimated with the time model
+		if (j->stats.time >= 0)
+			printf("%10.0f", j->stats.time);
+		else
+			printf("%10s", "-");
+		printf(" %8.1f\n", j->ms);
+	}
+	printf("%d files, %d failed, %d threads, %.0f ms\n", batch_count, failed,
+			batch_threads, (get_time() - t0) * 1000);
+
+	return failed ? 1 : 0;
+}
+#endif
+
 int main(int argc, char **argv)
 {
+	init_morton_spread_table();
+
 	while (1) {
 		if (argc > 1 && !strcmp(argv[1], "-x")) {
 			argc--; argv++;
 			drilling_ok = 1;
 			continue;
 		}
+		if (argc > 2 && !strcmp(argv[1], "-s")) {
+			gcode_rxbuf_size = CHECK(atoi(argv[2]), >= 0);
+			CHECK(gcode_rxbuf_size, <= GCODE_RXBUF_MAX);
+			argc -= 2; argv += 2;
+			continue;
+		}
+		if (argc > 2 && !strcmp(argv[1], "-t")) {
+			opt_time_budget = atoi(argv[2]);
+			argc -= 2; argv += 2;
+			continue;
+		}
+		if (argc > 2 && !strcmp(argv[1], "-B")) {
+			benchmark_sort(atoi(argv[2]));
+			benchmark_parse(atoi(argv[2]));
+			return 0;
+		}
+		if (argc > 2 && !strcmp(argv[1], "-k")) {
+			for (travel_model = travel_models; travel_model->name; travel_model++)
+				if (!strcmp(travel_model->name, argv[2]))
+					break;
+			CHECK(travel_model->name, != NULL);
+			argc -= 2; argv += 2;
+			continue;
+		}
+		if (argc > 2 && !strcmp(argv[1], "-o")) {
+			if (!strcmp(argv[2], "morton"))
+				order_mode = ORDER_MORTON;
+			else if (!strcmp(argv[2], "hilbert"))
+				order_mode = ORDER_HILBERT;
+			else
+				order_mode = CHECK(!strcmp(argv[2], "optimized") ? ORDER_OPTIMIZED : -1, >= 0);
+			argc -= 2; argv += 2;
+			continue;
+		}
+		if (argc > 2 && !strcmp(argv[1], "-d")) {
+			if (!strcmp(argv[2], "legacy"))
+				drill_cycle = DRILL_CYCLE_LEGACY;
+			else if (!strcmp(argv[2], "expand"))
+				drill_cycle = DRILL_CYCLE_EXPAND;
+			else if (!strcmp(argv[2], "g81"))
+				drill_cycle = DRILL_CYCLE_G81;
+			else
+				drill_cycle = CHECK(!strcmp(argv[2], "g83") ? DRILL_CYCLE_G83 : -1, >= 0);
+			argc -= 2; argv += 2;
+			continue;
+		}
+		if (argc > 2 && !strcmp(argv[1], "-H")) {
+			hop_distance = CHECK(atof(argv[2]), >= 0);
+			argc -= 2; argv += 2;
+			continue;
+		}
+		if (argc > 2 && !strcmp(argv[1], "-P")) {
+			correction_degree = atoi(argv[2]);
+			CHECK(correction_terms(correction_degree), > 0);
+			argc -= 2; argv += 2;
+			continue;
+		}
+		if (argc > 2 && !strcmp(argv[1], "-L")) {
+			CHECK(sscanf(argv[2], "%lf,%lf,%lf,%lf", &soft_limit_x[0], &soft_limit_y[0],
+					&soft_limit_x[1], &soft_limit_y[1]), == 4);
+			soft_limits = 1;
+			argc -= 2; argv += 2;
+			continue;
+		}
+		if (argc > 2 && !strcmp(argv[1], "-q")) {
+			peck_depth = CHECK(atof(argv[2]), > 0);
+			argc -= 2; argv += 2;
+			continue;
+		}
+		if (argc > 1 && !strcmp(argv[1], "-v")) {
+			argc--; argv++;
+			verbose = 1;
+			continue;
+		}
 		if (argc > 1 && !strcmp(argv[1], "-c")) {
 			argc--; argv++;
 			console_gui = 1;
@@ -843,16 +4037,78 @@ int main(int argc, char **argv)
 		if (argc > 1 && !strcmp(argv[1], "-g")) {
 			argc--; argv++;
 			blind_gcode_mode = 1;
+			console_stderr = 1;
+			continue;
+		}
+		if (argc > 1 && !strcmp(argv[1], "-r")) {
+			argc--; argv++;
+			stream_mode = 1;
+			blind_gcode_mode = 1;
+			console_stderr = 1;
+			continue;
+		}
+		if (argc > 1 && !strcmp(argv[1], "-b")) {
+			argc--; argv++;
+			batch_mode = 1;
+			blind_gcode_mode = 1;
+			console_stderr = 1;
+			continue;
+		}
+		if (argc > 2 && !strcmp(argv[1], "-j")) {
+			batch_threads = CHECK(atoi(argv[2]), > 0);
+			argc -= 2; argv += 2;
 			continue;
 		}
 		break;
 #endif
 	}
 
-	CHECK(argc, == 2 || _R == 3);
+	CHECK(argc, == 2 || _R == 3 || (batch_mode && _R > 1));
+	CHECK(argc, == 3 || !stream_mode);
 
 	if (argc == 3)
 		tts_device = argv[2];
+	else if (blind_gcode_mode)
+		tts_device = "-";
+
+	FILE *f;
+	set_default_matrixop(&active_matrixop);
+	if ((f = fopen("metadrill.mat", "r")) != NULL) {
+		fscanf(f, "%lf\n", &active_matrixop.a);
+		fscanf(f, "%lf\n", &active_matrixop.b);
+		fscanf(f, "%lf\n", &active_matrixop.c);
+		fscanf(f, "%lf\n", &active_matrixop.d);
+		fscanf(f, "%lf\n", &active_matrixop.e);
+		fscanf(f, "%lf\n", &active_matrixop.f);
+		fclose(f);
+	}
+	load_correction("metadrill.cor");
+	load_tool_profiles("metadrill.tools");
+
+	console("Loaded transfomation matrices:\n");
+	print_matrixop(&active_matrixop);
+	cnc_z = 0;
+
+#ifndef WIN32
+	if (batch_mode) {
+		if (batch_threads == 0)
+			batch_threads = sysconf(_SC_NPROCESSORS_ONLN);
+		return batch_convert(argv+1, argc-1);
+	}
+#endif
+
+	// the path optimizer uses the matrices to get machine distances
+	read_drlfile(argv[1]);
+	correction_report();
+	if (update_machine_coords() > 0 && blind_gcode_mode)
+		return 1;
+
+	if (stream_mode)
+		return stream_gcode();
+	if (blind_gcode_mode) {
+		compile_gcode(tts_device);
+		return 0;
+	}
 
 	CHECK(SDL_Init(SDL_INIT_VIDEO), >= 0);
 	SDL_WM_SetCaption("Metadrill", "Metadrill");
@@ -864,27 +4120,10 @@ int main(int argc, char **argv)
 	font = CHECK(TTF_OpenFont("font.ttf", 16), != NULL);
 	tiny_font = CHECK(TTF_OpenFont("font.ttf", 8), != NULL);
 
-	console("Loaded transfomation matrices:\n");
-	print_matrixop(&active_matrixop);
-	cnc_z = 0;
-
-	FILE *f = CHECK(fopen(argv[1], "r"), != NULL);
-	read_drlfile(f);
-	fclose(f);
-
-	set_default_matrixop(&active_matrixop);
-	if ((f = fopen("metadrill.mat", "r")) != NULL) {
-		fscanf(f, "%f\n", &active_matrixop.a);
-		fscanf(f, "%f\n", &active_matrixop.b);
-		fscanf(f, "%f\n", &active_matrixop.c);
-		fscanf(f, "%f\n", &active_matrixop.d);
-		fscanf(f, "%f\n", &active_matrixop.e);
-		fscanf(f, "%f\n", &active_matrixop.f);
-		fclose(f);
-	}
-
 	while (1)
 	{
+		gcode_poll();
+		drill_step();
 		draw_screen();
 
                 SDL_Event event;
@@ -892,6 +4131,13 @@ int main(int argc, char **argv)
                 while (!screen_needs_update && SDL_PollEvent(&event)) {
 			if (event.type == SDL_QUIT)
 				goto app_quit;
+			if (drilling) {
+				if (event.type == SDL_KEYDOWN) {
+					console("Aborting drilling.\n");
+					drill_abort();
+				}
+				continue;
+			}
 			if (event.type == SDL_KEYDOWN &&
 					event.key.keysym.sym == SDLK_q)
 				goto app_quit;
@@ -907,11 +4153,12 @@ int main(int argc, char **argv)
 				struct adjust_sample *adj = malloc(sizeof(struct adjust_sample));
 				adj->xf = target_x;
 				adj->yf = target_y;
-				adj->xp = cnc_x;
-				adj->yp = cnc_y;
+				adj->xp = nm_to_mm(cnc_x);
+				adj->yp = nm_to_mm(cnc_y);
 				adj->next = adj_list;
 				adj_list = adj;
 				adj_count++;
+				adjust_check();
 				screen_needs_update = 1;
 			}
 			if (event.type == SDL_KEYDOWN &&
@@ -926,6 +4173,7 @@ int main(int argc, char **argv)
 				fprintf(f, "%+e\n", active_matrixop.e);
 				fprintf(f, "%+e\n", active_matrixop.f);
 				fclose(f);
+				write_correction("metadrill.cor");
 			}
 			if (event.type == SDL_KEYDOWN &&
 					event.key.keysym.sym == SDLK_0)
@@ -1050,7 +4298,7 @@ int main(int argc, char **argv)
 					event.key.keysym.sym == SDLK_m)
 			{
 				current_autopos = 1;
-				move_cnc_head(target_x, target_y, Z_STATE_UP);
+				move_cnc_head(target_x, target_y, target_hole, Z_STATE_UP);
 			}
 			if (event.type == SDL_KEYDOWN &&
 					event.key.keysym.sym == SDLK_d)
@@ -1091,63 +4339,65 @@ int main(int argc, char **argv)
 			if (event.type == SDL_KEYDOWN &&
 					event.key.keysym.sym == SDLK_s)
 			{
-				struct pos *p;
-				drilling = 1;
-				screen_needs_update = 1;
-				for (p=drill_list; p; p=p->next) {
-					if (p->done)
-						continue;
-					while (SDL_PollEvent(&event)) {
-						if (event.type == SDL_QUIT)
-							goto app_quit;
-						if (event.type == SDL_KEYDOWN)
-							goto abort_drilling;
-					}
-					current_autopos = 1;
-					target_x = p->x;
-					target_y = p->y;
-					screen_needs_update = 1;
-					draw_screen();
-					move_cnc_head(target_x, target_y, Z_STATE_DOWN);
-					move_cnc_head(target_x, target_y, Z_STATE_UP);
-					p->done = 1;
+				int k = drill_tool;
+				if (holes.tool_count == 0 || drill_find_tool(drill_tool-1) != drill_tool)
+					k = drill_find_tool(-1);
+				// drill_tool stays a valid index for the status line and the feeds
+				drill_tool = k >= 0 ? k : 0;
+				if (k < 0) {
+					console("Nothing to drill.\n");
+				} else if (update_machine_coords() > 0) {
+					console("Not drilling, fix the calibration or the soft limits first.\n");
+				} else if (!drill_prompt[0] && gcode_tool != holes.tools[k].number) {
+					// no bit mounted yet, or not the one of the first tool
+					drill_tool_prompt(k);
+				} else {
+					drill_start_tool(k);
 				}
-abort_drilling:
-				drilling = 0;
 				screen_needs_update = 1;
 			}
+			if (event.type == SDL_MOUSEBUTTONDOWN &&
+					(event.button.button == SDL_BUTTON_WHEELUP ||
+					 event.button.button == SDL_BUTTON_WHEELDOWN))
+				view_zoom(event.button.button == SDL_BUTTON_WHEELUP ? 1.25 : 0.8,
+						event.button.x, event.button.y);
+			if (event.type == SDL_MOUSEMOTION && (event.motion.state & SDL_BUTTON_RMASK))
+				view_pan(event.motion.xrel, event.motion.yrel);
+			if (event.type == SDL_KEYDOWN && (event.key.keysym.sym == SDLK_PLUS ||
+					event.key.keysym.sym == SDLK_EQUALS || event.key.keysym.sym == SDLK_KP_PLUS))
+				view_zoom(1.25, 320, 230);
+			if (event.type == SDL_KEYDOWN && (event.key.keysym.sym == SDLK_MINUS ||
+					event.key.keysym.sym == SDLK_KP_MINUS))
+				view_zoom(0.8, 320, 230);
+			if (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_v)
+				view_reset();
 			if (event.type == SDL_MOUSEBUTTONDOWN &&
 					event.button.button == SDL_BUTTON_LEFT)
 			{
 				int x = event.button.x;
 				int y = event.button.y;
-				float best_delta = 20;
-
-				void checkpos(struct pos *p) {
-					float dx = fabs(get_screen_x(p->x) - x);
-					float dy = fabs(get_screen_y(p->y) - y);
-					float delta = sqrt(dx*dx + dy*dy);
-					if (delta < best_delta) {
-						best_delta = delta;
-						target_x = p->x;
-						target_y = p->y;
-						screen_needs_update = 1;
-					}
-				}
 
-				struct pos *p;
-				for (p=drill_list; p; p=p->next)
-					checkpos(p);
-				for (p=mark_list; p; p=p->next)
-					checkpos(p);
-				if (screen_needs_update)
-					console("New target position: X=%f, Y=%f\n",
-							target_x, target_y);
+				// nearest hole within 20 pixels
+				int i = hole_grid_nearest(&hole_index, holes.x, holes.y,
+						get_board_x(x), get_board_y(y), view_scale, view_scale,
+						20, NULL, NULL);
+				if (i >= 0) {
+					target_x = holes.x[i];
+					target_y = holes.y[i];
+					target_hole = i;
+					screen_needs_update = 1;
+					console("New target position: X=%f, Y=%f (machine X=%f, Y=%f)\n",
+							target_x, target_y, nm_to_mm(holes.mx[i]),
+							nm_to_mm(holes.my[i]));
+				}
 			}
 		}
 	}
 
 app_quit:
+	if (drilling)
+		gcode_abort();
+	gcode_quit();
 	console("Bye.\n");
 	return 0;
 }